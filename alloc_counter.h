@@ -0,0 +1,131 @@
+/*
+Heap allocation accounting for the engine.
+
+With -DSIMPLE_CROSS_ALLOCS ("make ALLOCS=1") this header replaces the global
+operator new and delete with versions that count allocations and bytes per
+thread before calling malloc. SimpleCross::execute() takes the difference
+over each action and charges it to the action's kind, separating what the
+engine itself allocated from what its result sink allocated (the results_t
+that action() builds, say).
+
+In strict mode the engine marks the thread while it is inside execute() and
+outside the sink; an allocation made while marked prints the allocation size
+and action number and aborts, so a hot path that is meant to be allocation
+free stays that way.
+
+The replacement operators are ordinary (not inline) definitions, so the
+header must end up in only one translation unit of a program; every program
+in this repository is a single one.
+*/
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <new>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <unistd.h>
+
+struct alloc_counts_t {
+  uint64_t allocations;
+  uint64_t bytes;
+};
+
+// Per thread; trivially constructible so operator new can use it at any time.
+struct alloc_thread_state_t {
+  alloc_counts_t engine;
+  alloc_counts_t sink;
+  int in_sink;          // nesting depth of sink calls
+  bool guarded;         // strict mode: allocations outside the sink abort
+  uint64_t action;      // sequence number of the action being guarded
+};
+
+inline alloc_thread_state_t& alloc_state(){
+  static thread_local alloc_thread_state_t state;
+  return state;
+}
+
+// Strict mode failure; must not allocate.
+inline void alloc_violation(size_t size, uint64_t action){
+  char text[128];
+  int length = snprintf(text, sizeof(text), "allocation of %llu bytes inside the matching hot path (action %llu)\n",
+                        (unsigned long long)size, (unsigned long long)action);
+  if (write(STDERR_FILENO, text, length) < 0){
+    // nothing left to report to
+  }
+  abort();
+}
+
+inline void* counted_alloc(size_t size){
+  alloc_thread_state_t& state = alloc_state();
+  alloc_counts_t& counts = state.in_sink ? state.sink : state.engine;
+  counts.allocations++;
+  counts.bytes += size;
+  if (state.guarded && state.in_sink == 0){
+    alloc_violation(size, state.action);
+  }
+  void* memory = malloc(size ? size : 1);
+  if (memory == NULL){
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+// Sink wrapper that marks its calls, so allocations in them are charged to
+// the sink and allowed in strict mode.
+template <typename Sink>
+struct alloc_sink_t {
+  alloc_sink_t(Sink& sink) : sink(sink) {}
+  void operator()(const char* text, size_t length){
+    alloc_state().in_sink++;
+    sink(text, length);
+    alloc_state().in_sink--;
+  }
+  Sink& sink;
+};
+
+// Allocations and bytes charged to one kind of action.
+struct alloc_stats_t {
+  uint64_t actions;
+  alloc_counts_t engine;
+  alloc_counts_t sink;
+};
+
+// "12 actions, 0.00 allocs/action, 0.0 bytes/action; sink 2.00 allocs/action, 70.0 bytes/action"
+inline std::string alloc_summary(const alloc_stats_t& stats){
+  char text[160];
+  double actions = stats.actions ? (double)stats.actions : 1.0;
+  snprintf(text, sizeof(text), "%llu actions, %.2f allocs/action, %.1f bytes/action; sink %.2f allocs/action, %.1f bytes/action",
+           (unsigned long long)stats.actions, stats.engine.allocations / actions, stats.engine.bytes / actions,
+           stats.sink.allocations / actions, stats.sink.bytes / actions);
+  return text;
+}
+
+#ifdef SIMPLE_CROSS_ALLOCS
+void* operator new(size_t size){
+  return counted_alloc(size);
+}
+
+void* operator new[](size_t size){
+  return counted_alloc(size);
+}
+
+void operator delete(void* memory) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+  free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+  free(memory);
+}
+#endif
+
+#endif
@@ -0,0 +1,287 @@
+/*
+Binary checkpoints of the engine for fast restart.
+
+A checkpoint holds every resting order (by symbol, side, price level and
+priority), every retired order id, and the journal sequence number of the
+last action it includes:
+
+    checkpoint_header_t
+    checkpoint_order_t * (live_orders + retired_orders), live orders first
+    checkpoint_trailer_t
+
+Restart loads the newest checkpoint by mapping the file, then replays the
+journal records that follow its sequence number (see simple_cross.cpp).
+
+Checkpoints are written in the background: the matcher forks after an action
+and the child, which sees a copy-on-write image of the engine frozen at that
+point, writes FILE.tmp, syncs it and renames it over FILE, so FILE is always
+a complete checkpoint. The matcher only pays for the fork itself. A
+checkpoint that is due while the previous one is still being written is
+skipped.
+*/
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "simple_cross.h"
+#include "journal.h"
+
+const uint64_t CHECKPOINT_MAGIC = 0x544e504b43584953ULL;
+const uint32_t CHECKPOINT_VERSION = 1;
+
+struct checkpoint_header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t sequence;        // journal sequence of the last action included
+  uint64_t created_ns;
+  uint64_t live_orders;
+  uint64_t retired_orders;
+};
+
+struct checkpoint_order_t {
+  uint32_t oid;
+  uint32_t open_qty;        // 0 for retired orders
+  double px;                // price the order was entered with
+  char symbol[8];           // NUL padded
+  char side;
+  char padding[7];
+};
+
+struct checkpoint_trailer_t {
+  uint64_t orders;
+  uint64_t magic;
+};
+
+// Writes a checkpoint of `engine` as of `sequence` to path.tmp and renames it
+// over path. Returns false and fills error on failure.
+inline bool write_checkpoint(SimpleCross& engine, uint64_t sequence, const std::string& path, std::string& error){
+  std::string temporary = path + ".tmp";
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0){
+    error = "Cannot create checkpoint " + temporary + ": " + strerror(errno);
+    return false;
+  }
+  checkpoint_header_t header = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, 0, sequence, journal_wall_ns(), 0, 0};
+  std::string buffer(reinterpret_cast<const char*>(&header), sizeof(header));
+  bool written = true;
+  engine.for_each_order([&](int oid, const std::string& symbol, char side, double px, int open_qty, bool live){
+    checkpoint_order_t order;
+    memset(&order, 0, sizeof(order));
+    order.oid = oid;
+    order.open_qty = open_qty;
+    order.px = px;
+    order.side = side;
+    memcpy(order.symbol, symbol.data(), std::min(symbol.size(), sizeof(order.symbol)));
+    (live ? header.live_orders : header.retired_orders)++;
+    buffer.append(reinterpret_cast<const char*>(&order), sizeof(order));
+    if (buffer.size() >= (1 << 20)){
+      written = written && write(fd, buffer.data(), buffer.size()) == (ssize_t)buffer.size();
+      buffer.clear();
+    }
+  });
+  checkpoint_trailer_t trailer = {header.live_orders + header.retired_orders, CHECKPOINT_MAGIC};
+  buffer.append(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+  written = written && write(fd, buffer.data(), buffer.size()) == (ssize_t)buffer.size()
+    && pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && fdatasync(fd) == 0;
+  close(fd);
+  if (!written || rename(temporary.c_str(), path.c_str()) != 0){
+    error = "Cannot write checkpoint " + path + ": " + strerror(errno);
+    unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Restores a checkpoint into an empty engine. A missing file is not an error:
+// found is set to false and sequence to 0.
+inline bool load_checkpoint(SimpleCross& engine, const std::string& path, uint64_t& sequence, bool& found, std::string& error){
+  sequence = 0;
+  int fd = open(path.c_str(), O_RDONLY);
+  found = fd >= 0;
+  if (!found){
+    if (errno == ENOENT){
+      return true;
+    }
+    error = "Cannot open checkpoint " + path + ": " + strerror(errno);
+    return false;
+  }
+  struct stat info;
+  void* memory = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(checkpoint_header_t) + sizeof(checkpoint_trailer_t)){
+    memory = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  }
+  close(fd);
+  if (memory == MAP_FAILED){
+    error = "Cannot map checkpoint " + path;
+    return false;
+  }
+  const char* data = static_cast<const char*>(memory);
+  checkpoint_header_t header;
+  checkpoint_trailer_t trailer;
+  memcpy(&header, data, sizeof(header));
+  memcpy(&trailer, data + info.st_size - sizeof(trailer), sizeof(trailer));
+  uint64_t orders = header.live_orders + header.retired_orders;
+  if (header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION || trailer.magic != CHECKPOINT_MAGIC
+      || trailer.orders != orders || (uint64_t)info.st_size != sizeof(header) + orders * sizeof(checkpoint_order_t) + sizeof(trailer)){
+    error = "File " + path + " is not a complete SimpleCross checkpoint";
+    munmap(memory, info.st_size);
+    return false;
+  }
+  engine.reserve(orders);
+  const char* position = data + sizeof(header);
+  for (uint64_t i = 0; i < orders; i++, position += sizeof(checkpoint_order_t)){
+    checkpoint_order_t order;
+    memcpy(&order, position, sizeof(order));
+    engine.restore_order(order.oid, std::string(order.symbol, strnlen(order.symbol, sizeof(order.symbol))),
+                         order.side, order.px, order.open_qty, i < header.live_orders);
+  }
+  munmap(memory, info.st_size);
+  sequence = header.sequence;
+  engine.sequence() = sequence;
+  return true;
+}
+
+// Restart: loads the checkpoint (if checkpoint_path is set and exists), then
+// replays the records of the journal (if journal_path is set and exists) that
+// follow it, checking that they produce the recorded results; the journal is
+// replayed with the book deltas it was recorded with. The engine may
+// already hold a book (a mapped book file) as of action `sequence`, in which
+// case no checkpoint is loaded. sequence ends as the number of the last
+// action applied.
+inline bool recover_engine(SimpleCross& engine, const std::string& checkpoint_path, const std::string& journal_path,
+                           uint64_t& sequence, std::string& error){
+  bool found = false;
+  if (sequence == 0 && !checkpoint_path.empty() && !load_checkpoint(engine, checkpoint_path, sequence, found, error)){
+    return false;
+  }
+  struct stat info;
+  uint64_t replayed = 0, mismatched = 0;
+  journal_reader_t reader;
+  journal_entry_t entry;
+  if (!journal_path.empty() && stat(journal_path.c_str(), &info) == 0 && info.st_size > 0){
+    if (!reader.open(journal_path, error)){
+      return false;
+    }
+    if (reader.first_sequence() > sequence + 1){
+      error = "Journal " + journal_path + " starts after action " + std::to_string(sequence + 1) + ", the book cannot be rebuilt";
+      return false;
+    }
+  }
+  book_deltas_t deltas = engine.book_deltas();
+  if (reader.is_open()){
+    engine.set_book_deltas(reader.book_deltas());
+  }
+  while (reader.is_open() && reader.next(entry)){
+    if (entry.sequence <= sequence){
+      continue;
+    }
+    results_t results = engine.action(entry.action);
+    bool compared = !is_stats_action(entry.action.data(), entry.action.size());
+    if (compared && (results.size() != entry.results.size() || !std::equal(results.begin(), results.end(), entry.results.begin()))){
+      mismatched++;
+    }
+    sequence = entry.sequence;
+    replayed++;
+  }
+  engine.set_book_deltas(deltas);
+  if (found || replayed > 0){
+    std::cerr << "recovered through action " << sequence << (found ? " from checkpoint " + checkpoint_path : std::string())
+              << ", " << replayed << " journal records replayed";
+    if (mismatched > 0){
+      std::cerr << ", " << mismatched << " produced different results than recorded";
+    }
+    std::cerr << std::endl;
+  }
+  return true;
+}
+
+// Counts actions and starts a background checkpoint every `interval`
+// actions. Sits in front of the journal on the engine's action_log_t hook.
+class checkpointer_t : public action_log_t
+{
+public:
+    checkpointer_t(SimpleCross& engine) : engine(engine), next(NULL), interval(0), sequence(0), child(-1) {}
+
+    // Checkpoints go to path every `every` actions (never if 0); records are
+    // passed on to `journal` (may be NULL). first_sequence is the number of
+    // the last action already included in the engine's state.
+    void start(const std::string& checkpoint_path, uint64_t every, uint64_t first_sequence, action_log_t* journal){
+      path = checkpoint_path;
+      interval = every;
+      sequence = first_sequence;
+      next = journal;
+    }
+
+    void record(const std::string& line, const results_t& results){
+      if (next != NULL){
+        next->record(line, results);
+      }
+      sequence++;
+      if (child > 0){
+        reap(false);
+      }
+      if (interval > 0 && sequence % interval == 0 && child < 0){
+        checkpoint_in_background();
+      }
+    }
+
+    // Waits for a background checkpoint and writes a final one in the
+    // foreground. Used at a clean shutdown.
+    bool finish(){
+      if (child > 0){
+        reap(true);
+      }
+      std::string error;
+      if (!write_checkpoint(engine, sequence, path, error)){
+        std::cerr << error << std::endl;
+        return false;
+      }
+      return true;
+    }
+private:
+    void checkpoint_in_background(){
+      pid_t pid = fork();
+      if (pid < 0){
+        std::cerr << "checkpoint skipped, fork failed: " << strerror(errno) << std::endl;
+        return;
+      }
+      if (pid == 0){
+        std::string error;
+        bool written = write_checkpoint(engine, sequence, path, error);
+        if (!written){
+          fprintf(stderr, "%s\n", error.c_str());
+        }
+        _exit(written ? 0 : 1);
+      }
+      child = pid;
+    }
+
+    void reap(bool wait){
+      int status;
+      pid_t pid = waitpid(child, &status, wait ? 0 : WNOHANG);
+      if (pid == child || (pid < 0 && errno == ECHILD)){
+        child = -1;
+      }
+    }
+
+    SimpleCross& engine;
+    action_log_t* next;
+    std::string path;
+    uint64_t interval;
+    uint64_t sequence;
+    pid_t child;
+};
+
+#endif
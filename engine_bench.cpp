@@ -0,0 +1,179 @@
+// Throughput benchmark of the engine on synthetic order flow (see workload.h).
+//
+//     ./engine_bench [--actions N] [--symbols N] [--zipf S] [--cancel-ratio R]
+//                    [--aggressive-ratio R] [--depth N] [--volatility P]
+//                    [--max-qty N] [--seed N] [--perf] [--strict-allocs N]
+//                    [--emit]
+//
+// The actions are generated up front, then fed to SimpleCross::action() one
+// by one and timed as a whole. Reports actions/s, fills/s (one per F result
+// line, so a trade counts twice) and the peak resident set size. --perf
+// also counts cycles, instructions, cache, branch and dTLB misses over the
+// generation and the matching phase (see perf_counters.h) and reports them
+// per action, which tells a layout change that fixed cache behaviour from
+// one that only moved the wall time.
+//
+// --strict-allocs N (with "make ALLOCS=1") aborts on the first heap
+// allocation the engine makes inside an action after the first N actions.
+// The order pool, the id index, every symbol's book and its price level
+// vectors are sized before the timed run, so the default flow runs through
+// without one; "make strictbench" checks that.
+//
+// --emit prints the actions instead, e.g. to drive
+// "./simple_cross --input -".
+//
+// "make bench" builds and runs it; BENCH_ARGS="..." passes options.
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sys/resource.h>
+
+#include "simple_cross.h"
+#include "workload.h"
+#include "perf_counters.h"
+
+// Price levels per side reserved for every symbol in strict allocation mode,
+// per tick of --depth plus 8. Stale orders spread a side over more ticks
+// than --depth as the mid wanders; this covers the default flow several
+// times over.
+const size_t STRICT_LEVELS_PER_TICK = 32;
+
+struct bench_options_t {
+  size_t actions = 1000000;
+  bool emit = false;
+  bool perf = false;
+  long strict_allocs = -1;        // warmup actions before strict mode; -1 off
+  workload_options_t workload;
+};
+
+// Reads the value following argv[i] with strtod; false if missing or malformed.
+bool option_value(int argc, char** argv, int& i, double& value){
+  if (i+1 >= argc){
+    return false;
+  }
+  char* end = NULL;
+  value = std::strtod(argv[++i], &end);
+  return *argv[i] != '\0' && *end == '\0' && value >= 0;
+}
+
+bool parse_bench_options(int argc, char** argv, bench_options_t& opts){
+  workload_options_t& workload = opts.workload;
+  for (int i = 1; i < argc; i++){
+    std::string arg = argv[i];
+    double value = 0;
+    if (arg == "--emit"){
+      opts.emit = true;
+    } else if (arg == "--perf"){
+      opts.perf = true;
+    } else if (arg == "--strict-allocs" && option_value(argc, argv, i, value)){
+      opts.strict_allocs = (long)value;
+    } else if (arg == "--actions" && option_value(argc, argv, i, value)){
+      opts.actions = (size_t)value;
+    } else if (arg == "--symbols" && option_value(argc, argv, i, value) && value >= 1){
+      workload.symbols = (size_t)value;
+    } else if (arg == "--zipf" && option_value(argc, argv, i, value)){
+      workload.zipf = value;
+    } else if (arg == "--cancel-ratio" && option_value(argc, argv, i, value) && value <= 1){
+      workload.cancel_ratio = value;
+    } else if (arg == "--aggressive-ratio" && option_value(argc, argv, i, value) && value <= 1){
+      workload.aggressive_ratio = value;
+    } else if (arg == "--depth" && option_value(argc, argv, i, value) && value >= 1){
+      workload.depth = (int)value;
+    } else if (arg == "--volatility" && option_value(argc, argv, i, value) && value <= 1){
+      workload.volatility = value;
+    } else if (arg == "--max-qty" && option_value(argc, argv, i, value) && value >= 1){
+      workload.max_qty = (int)value;
+    } else if (arg == "--seed" && option_value(argc, argv, i, value)){
+      workload.seed = (uint64_t)value;
+    } else {
+      std::cerr << "Invalid option " << arg << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+    bench_options_t opts;
+    if (!parse_bench_options(argc, argv, opts)){
+        std::cerr << "usage: " << argv[0] << " [--actions N] [--symbols N] [--zipf S] [--cancel-ratio R]" << std::endl
+                  << "       [--aggressive-ratio R] [--depth N] [--volatility P] [--max-qty N] [--seed N] [--perf]" << std::endl
+                  << "       [--strict-allocs N] [--emit]" << std::endl;
+        return 1;
+    }
+    perf_counters_t counters;
+    if (opts.perf){
+        std::string error;
+        if (!counters.open(error)){
+            std::cerr << "Cannot open performance counters: " << error << std::endl;
+            return 1;
+        }
+    }
+    workload_t workload(opts.workload);
+    std::vector<std::string> actions(opts.actions);
+    counters.start();
+    for (std::string& line : actions){
+        workload.next(line);
+    }
+    perf_reading_t generate_perf = counters.stop();
+    if (opts.emit){
+        for (const std::string& line : actions){
+            std::cout << line << '\n';
+        }
+        return 0;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long workload_rss = usage.ru_maxrss;
+    SimpleCross scross;
+    if (opts.strict_allocs >= 0){
+#ifdef SIMPLE_CROSS_ALLOCS
+        scross.reserve(actions.size());
+        scross.reserve_levels(workload.symbol_names(), STRICT_LEVELS_PER_TICK * (opts.workload.depth + 8));
+        scross.strict_allocations(opts.strict_allocs);
+#else
+        std::cerr << "--strict-allocs needs a build with allocation counting (make ALLOCS=1)" << std::endl;
+        return 1;
+#endif
+    }
+    size_t results = 0, fills = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    counters.start();
+    for (const std::string& line : actions){
+        results_t output = scross.action(line);
+        results += output.size();
+        for (const std::string& result : output){
+            fills += result[0] == 'F';
+        }
+    }
+    perf_reading_t match_perf = counters.stop();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    getrusage(RUSAGE_SELF, &usage);
+    const workload_options_t& w = opts.workload;
+    std::cout << "workload: " << actions.size() << " actions, " << w.symbols << " symbols, zipf " << w.zipf
+              << ", cancel ratio " << w.cancel_ratio << ", aggressive ratio " << w.aggressive_ratio
+              << ", depth " << w.depth << ", volatility " << w.volatility << ", seed " << w.seed << std::endl;
+    std::cout << "elapsed: " << seconds << " s, " << results << " results, " << fills << " fills" << std::endl;
+    std::cout << "actions/s: " << (uint64_t)(actions.size() / seconds) << std::endl;
+    std::cout << "fills/s: " << (uint64_t)(fills / seconds) << std::endl;
+    std::cout << "peak RSS: " << usage.ru_maxrss << " KB (" << workload_rss << " KB before the engine ran)" << std::endl;
+    if (opts.perf){
+        std::cout << perf_summary("generate", generate_perf, actions.size(), "action") << std::endl;
+        std::cout << perf_summary("match", match_perf, actions.size(), "action") << std::endl;
+    }
+#ifdef SIMPLE_CROSS_LATENCY
+    std::cout << scross.latency_report();
+#endif
+#ifdef SIMPLE_CROSS_PROBES
+    std::cout << probe_report();
+#endif
+#ifdef SIMPLE_CROSS_ALLOCS
+    std::cout << scross.allocation_report();
+#endif
+    return 0;
+}
@@ -0,0 +1,675 @@
+/*
+Append-only binary journal of every action and the results it produced.
+
+File layout:
+
+    journal_file_header_t
+    record*      varint length, u32 CRC-32 of the payload, then `length`
+                 bytes of payload: varint nanoseconds since the previous
+                 record (since created_ns for the first), varint result
+                 count, the action item, one item per result
+
+The header also records the --deltas setting, since L and B lines are
+results like any other: recovery and replay run the engine with the same
+setting, and a journal is only continued with it.
+
+Records are numbered from first_sequence in file order. Numbers are stored as
+little-endian base-128 varints. An item is one protocol line. Lines in the
+usual shapes are stored as binary fields ("O 10000 IBM B 10 100.0" as oid,
+symbol, side, qty and the price as an integer count of its last decimal
+digit); anything else, malformed input included, is stored as text. Every
+binary item is checked to decode back to the exact original line, so a reader
+always gets the original bytes. A typical order record takes about as many
+bytes as its text line alone.
+
+A crash can leave a torn record at the tail; readers stop at the first
+incomplete or corrupt record.
+
+Records are appended by the matcher into an in-memory buffer and written by
+a background thread with group commit: the buffer goes out once `batch`
+records are pending or `interval_us` after the first of them arrived,
+whichever comes first. Durability modes:
+
+    async   write(), no fdatasync; survives a process crash, not a power loss
+    group   fdatasync after every group; results are released immediately,
+            so up to one group can be lost on power loss
+    sync    fdatasync after every group and drivers hold results back until
+            the record that produced them is durable (write-ahead)
+
+The engine is deterministic, so a record holding an action together with its
+results is written before any of those results become visible in sync mode.
+*/
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "simple_cross.h"
+
+const uint64_t JOURNAL_MAGIC = 0x4c4e524a58534fULL;
+const uint32_t JOURNAL_VERSION = 1;
+
+enum journal_mode_t {
+  JOURNAL_ASYNC,
+  JOURNAL_GROUP,
+  JOURNAL_SYNC
+};
+
+enum journal_item_t {
+  JOURNAL_TEXT = 0,     // varint length, bytes
+  JOURNAL_ORDER = 1,    // "O|P OID SYMBOL SIDE QTY PX": action, side, oid, qty, px, symbol
+  JOURNAL_FILL = 2,     // "F OID SYMBOL QTY PX": oid, qty, px, symbol
+  JOURNAL_ID = 3,       // "X|E OID" (no message): action, oid
+  JOURNAL_BARE = 4      // single character line such as "P": action
+};
+
+// Binary fields: action and side are single bytes, oid and qty varints, px
+// a varint count of units of the last decimal digit followed by a byte with
+// the number of decimals, symbol a length byte followed by the characters.
+
+struct journal_file_header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t deltas;              // book_deltas_t the results include
+  uint64_t created_ns;
+  uint64_t first_sequence;
+};
+
+// One decoded record.
+struct journal_entry_t {
+  uint64_t sequence;
+  uint64_t time_ns;
+  std::string action;
+  std::vector<std::string> results;
+};
+
+inline bool parse_journal_mode(const std::string& name, journal_mode_t& mode){
+  if (name == "async"){
+    mode = JOURNAL_ASYNC;
+  } else if (name == "group"){
+    mode = JOURNAL_GROUP;
+  } else if (name == "sync"){
+    mode = JOURNAL_SYNC;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+struct journal_crc_table_t {
+  uint32_t entries[256];
+  journal_crc_table_t(){
+    for (uint32_t i = 0; i < 256; i++){
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++){
+        crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+      }
+      entries[i] = crc;
+    }
+  }
+};
+
+inline uint32_t journal_crc32(const char* data, size_t length){
+  static const journal_crc_table_t table;
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < length; i++){
+    crc = table.entries[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFFu;
+}
+
+inline uint64_t journal_wall_ns(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline void journal_put_varint(std::string& out, uint64_t value){
+  while (value >= 0x80){
+    out.push_back((char)(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back((char)value);
+}
+
+inline bool journal_get_varint(const char*& data, const char* end, uint64_t& value){
+  value = 0;
+  for (int shift = 0; data < end && shift < 64; shift += 7){
+    unsigned char byte = *data++;
+    value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)){
+      return true;
+    }
+  }
+  return false;
+}
+
+inline bool journal_get_byte(const char*& data, const char* end, char& value){
+  if (data == end){
+    return false;
+  }
+  value = *data++;
+  return true;
+}
+
+// Appends `units` written with `decimals` digits after the decimal point.
+inline void journal_format_price(std::string& line, uint64_t units, int decimals){
+  char digits[24];
+  int length = snprintf(digits, sizeof(digits), "%0*llu", decimals + 1, (unsigned long long)units);
+  line.append(digits, length - decimals);
+  if (decimals > 0){
+    line.push_back('.');
+    line.append(digits + length - decimals, decimals);
+  }
+}
+
+// Decodes one item into `line`. Returns false on a malformed payload.
+inline bool journal_decode_item(const char*& data, const char* end, std::string& line){
+  char type, action = 0, side = 0, decimals = 0, length = 0;
+  uint64_t oid = 0, qty = 0, units = 0, text_length = 0;
+  line.clear();
+  if (!journal_get_byte(data, end, type)){
+    return false;
+  }
+  switch (type){
+    case JOURNAL_TEXT:
+      if (!journal_get_varint(data, end, text_length) || (uint64_t)(end - data) < text_length){
+        return false;
+      }
+      line.assign(data, text_length);
+      data += text_length;
+      return true;
+    case JOURNAL_ORDER:
+    case JOURNAL_FILL:
+      if ((type == JOURNAL_ORDER && (!journal_get_byte(data, end, action) || !journal_get_byte(data, end, side)))
+          || !journal_get_varint(data, end, oid) || !journal_get_varint(data, end, qty)
+          || !journal_get_varint(data, end, units) || !journal_get_byte(data, end, decimals)
+          || !journal_get_byte(data, end, length) || length < 0 || end - data < length || decimals < 0 || decimals > 19){
+        return false;
+      }
+      line.push_back(type == JOURNAL_ORDER ? action : 'F');
+      line.push_back(' ');
+      line.append(std::to_string(oid));
+      line.push_back(' ');
+      line.append(data, length);
+      data += length;
+      if (type == JOURNAL_ORDER){
+        line.push_back(' ');
+        line.push_back(side);
+      }
+      line.push_back(' ');
+      line.append(std::to_string(qty));
+      line.push_back(' ');
+      journal_format_price(line, units, decimals);
+      return true;
+    case JOURNAL_ID:
+      if (!journal_get_byte(data, end, action) || !journal_get_varint(data, end, oid)){
+        return false;
+      }
+      line.push_back(action);
+      line.push_back(' ');
+      line.append(std::to_string(oid));
+      return true;
+    case JOURNAL_BARE:
+      if (!journal_get_byte(data, end, action)){
+        return false;
+      }
+      line.push_back(action);
+      return true;
+  }
+  return false;
+}
+
+// Reads an unsigned decimal field of at most 19 digits.
+inline bool journal_field_number(const char*& p, const char* end, uint64_t& value){
+  const char* start = p;
+  value = 0;
+  while (p < end && *p >= '0' && *p <= '9' && p - start < 19){
+    value = value * 10 + (*p++ - '0');
+  }
+  return p != start;
+}
+
+// Appends the binary form of `line` when it has one of the usual shapes and
+// decodes back to exactly the same bytes, otherwise the text form.
+inline void journal_encode_item(const std::string& line, std::string& out){
+  size_t mark = out.size();
+  const char* p = line.data();
+  const char* end = p + line.size();
+  bool encoded = false;
+  uint64_t oid, qty, units;
+  if (line.size() == 1){
+    out.push_back((char)JOURNAL_BARE);
+    out.push_back(line[0]);
+    encoded = true;
+  } else if (line.size() > 2 && line[1] == ' '){
+    char action = line[0];
+    p += 2;
+    if (journal_field_number(p, end, oid)){
+      if (p == end && (action == 'X' || action == 'E')){
+        out.push_back((char)JOURNAL_ID);
+        out.push_back(action);
+        journal_put_varint(out, oid);
+        encoded = true;
+      } else if (p < end && *p == ' ' && (action == 'O' || action == 'P' || action == 'F')){
+        const char* symbol = ++p;
+        while (p < end && *p != ' '){
+          p++;
+        }
+        size_t symbol_length = p - symbol;
+        char side = 0;
+        bool fields = symbol_length > 0 && symbol_length <= 8 && p < end;
+        if (fields && action != 'F'){
+          fields = end - p > 3 && p[2] == ' ';
+          side = fields ? p[1] : 0;
+          p += 2;
+        }
+        if (fields && *p == ' ' && journal_field_number(++p, end, qty) && p < end && *p == ' '){
+          const char* price = ++p;
+          const char* dot = NULL;
+          units = 0;
+          while (p < end && p - price < 20 && ((*p >= '0' && *p <= '9') || (*p == '.' && dot == NULL))){
+            if (*p == '.'){
+              dot = p;
+            } else {
+              units = units * 10 + (*p - '0');
+            }
+            p++;
+          }
+          if (p == end && price < end){
+            if (action == 'F'){
+              out.push_back((char)JOURNAL_FILL);
+            } else {
+              out.push_back((char)JOURNAL_ORDER);
+              out.push_back(action);
+              out.push_back(side);
+            }
+            journal_put_varint(out, oid);
+            journal_put_varint(out, qty);
+            journal_put_varint(out, units);
+            out.push_back((char)(dot == NULL ? 0 : end - dot - 1));
+            out.push_back((char)symbol_length);
+            out.append(symbol, symbol_length);
+            encoded = true;
+          }
+        }
+      }
+    }
+  }
+  if (encoded){
+    const char* item = out.data() + mark;
+    std::string decoded;
+    if (journal_decode_item(item, out.data() + out.size(), decoded) && decoded == line){
+      return;
+    }
+    out.resize(mark);
+  }
+  out.push_back((char)JOURNAL_TEXT);
+  journal_put_varint(out, line.size());
+  out.append(line);
+}
+
+// S actions answer with statistics that are not a function of the session,
+// so replay and recovery do not compare their recorded results.
+inline bool is_stats_action(const char* line, size_t length){
+  return length > 0 && line[0] == 'S' && (length == 1 || line[1] == ' ');
+}
+
+// Reader side: maps a journal read-only and decodes it record by record.
+class journal_reader_t
+{
+public:
+    journal_reader_t() : data(NULL), size(0), offset(0), torn(false), next_sequence(0), previous_ns(0) {}
+
+    ~journal_reader_t(){
+      if (data != NULL){
+        munmap((void*)data, size);
+      }
+    }
+
+    bool open(const std::string& path, std::string& error){
+      int fd = ::open(path.c_str(), O_RDONLY);
+      struct stat info;
+      if (fd < 0 || fstat(fd, &info) != 0){
+        error = "Cannot open journal " + path + ": " + strerror(errno);
+        if (fd >= 0) ::close(fd);
+        return false;
+      }
+      size = info.st_size;
+      if (size < sizeof(journal_file_header_t)){
+        error = "Journal " + path + " has no header";
+        ::close(fd);
+        return false;
+      }
+      void* memory = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (memory == MAP_FAILED){
+        error = "Cannot map journal " + path + ": " + strerror(errno);
+        return false;
+      }
+      data = static_cast<const char*>(memory);
+      madvise(memory, size, MADV_SEQUENTIAL);
+      memcpy(&header, data, sizeof(header));
+      if (header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION || header.deltas > DELTAS_ORDER){
+        error = "File " + path + " is not a SimpleCross journal";
+        return false;
+      }
+      offset = sizeof(header);
+      next_sequence = header.first_sequence;
+      previous_ns = header.created_ns;
+      return true;
+    }
+
+    // Decodes the next record. Returns false at the end of the journal or at
+    // a torn/corrupt record (see torn_tail()).
+    bool next(journal_entry_t& entry){
+      const char* position = data + offset;
+      const char* end = data + size;
+      uint64_t length, delta_ns, count;
+      uint32_t checksum;
+      if (position == end){
+        return false;
+      }
+      if (!journal_get_varint(position, end, length) || (size_t)(end - position) < sizeof(checksum)
+          || length > (uint64_t)(end - position) - sizeof(checksum)){
+        torn = true;
+        return false;
+      }
+      memcpy(&checksum, position, sizeof(checksum));
+      position += sizeof(checksum);
+      const char* payload_end = position + length;
+      if (journal_crc32(position, length) != checksum || !journal_get_varint(position, payload_end, delta_ns)
+          || !journal_get_varint(position, payload_end, count) || count > length
+          || !journal_decode_item(position, payload_end, entry.action)){
+        torn = true;
+        return false;
+      }
+      entry.results.resize(count);
+      for (uint64_t i = 0; i < count; i++){
+        if (!journal_decode_item(position, payload_end, entry.results[i])){
+          torn = true;
+          return false;
+        }
+      }
+      previous_ns += delta_ns;
+      entry.sequence = next_sequence++;
+      entry.time_ns = previous_ns;
+      offset = payload_end - data;
+      return true;
+    }
+
+    // True if reading stopped at an incomplete or corrupt record rather than
+    // at the end of the file.
+    bool torn_tail() const {
+      return torn;
+    }
+
+    // Offset of the first byte after the last good record.
+    size_t valid_bytes() const {
+      return offset;
+    }
+
+    uint64_t created_ns() const {
+      return header.created_ns;
+    }
+
+    uint64_t first_sequence() const {
+      return header.first_sequence;
+    }
+
+    book_deltas_t book_deltas() const {
+      return (book_deltas_t)header.deltas;
+    }
+
+    bool is_open() const {
+      return data != NULL;
+    }
+
+    // Sequence number and time of the last record decoded so far.
+    uint64_t last_sequence() const {
+      return next_sequence - 1;
+    }
+
+    uint64_t last_time_ns() const {
+      return previous_ns;
+    }
+private:
+    const char* data;
+    size_t size;
+    size_t offset;
+    bool torn;
+    uint64_t next_sequence;
+    uint64_t previous_ns;
+    journal_file_header_t header;
+};
+
+// Writer side. record() is called by the matcher through the engine's
+// action_log_t hook; a background thread writes and syncs groups of records.
+class journal_t : public action_log_t
+{
+public:
+    journal_t() : fd(-1), mode(JOURNAL_GROUP), interval_us(200), batch(256), last_sequence(0), previous_ns(0),
+                  pending_records(0), first_pending_ns(0), stopping(false), failed(false), durable(0) {}
+
+    ~journal_t(){
+      close();
+    }
+
+    // Opens the journal at `path` for appending records numbered from
+    // next_sequence. An existing journal whose last good record is
+    // next_sequence - 1 is continued (a torn tail is cut off); one that does
+    // not line up is kept as PATH.FIRST_SEQUENCE and a new journal started.
+    // One recorded with other book deltas is refused. Then starts the writer
+    // thread.
+    bool open(const std::string& path, journal_mode_t journal_mode, uint64_t group_interval_us, size_t group_batch,
+              uint64_t next_sequence, book_deltas_t deltas, std::string& error){
+      struct stat info;
+      bool resume = false;
+      if (stat(path.c_str(), &info) == 0 && info.st_size > 0){
+        journal_reader_t reader;
+        journal_entry_t entry;
+        if (!reader.open(path, error)){
+          return false;
+        }
+        while (reader.next(entry)){
+        }
+        resume = reader.last_sequence() + 1 == next_sequence;
+        if (resume && reader.book_deltas() != deltas){
+          error = "Journal " + path + " was recorded with a different --deltas setting";
+          return false;
+        }
+        if (resume){
+          previous_ns = reader.last_time_ns();
+          if (truncate(path.c_str(), reader.valid_bytes()) != 0){
+            error = "Cannot cut torn tail of journal " + path + ": " + strerror(errno);
+            return false;
+          }
+        } else if (rename(path.c_str(), (path + "." + std::to_string(reader.first_sequence())).c_str()) != 0){
+          error = "Cannot move aside journal " + path + ": " + strerror(errno);
+          return false;
+        }
+      }
+      fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC), 0644);
+      if (fd < 0){
+        error = "Cannot open journal " + path + ": " + strerror(errno);
+        return false;
+      }
+      mode = journal_mode;
+      interval_us = group_interval_us;
+      batch = group_batch > 0 ? group_batch : 1;
+      last_sequence = next_sequence - 1;
+      durable.store(last_sequence);
+      if (!resume){
+        previous_ns = journal_wall_ns();
+        journal_file_header_t header = {JOURNAL_MAGIC, JOURNAL_VERSION, deltas, previous_ns, next_sequence};
+        active.append(reinterpret_cast<const char*>(&header), sizeof(header));
+      }
+      writer = std::thread([this]() { write_groups(); });
+      return true;
+    }
+
+    // Appends the record for one action. Never waits for the disk.
+    void record(const std::string& line, const results_t& results){
+      uint64_t time_ns = journal_wall_ns();
+      std::lock_guard<std::mutex> lock(mutex);
+      time_ns = std::max(time_ns, previous_ns);
+      payload.clear();
+      journal_put_varint(payload, time_ns - previous_ns);
+      journal_put_varint(payload, results.size());
+      journal_encode_item(line, payload);
+      for (const std::string& result : results){
+        journal_encode_item(result, payload);
+      }
+      uint32_t checksum = journal_crc32(payload.data(), payload.size());
+      journal_put_varint(active, payload.size());
+      active.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+      active.append(payload);
+      previous_ns = time_ns;
+      last_sequence++;
+      if (pending_records++ == 0){
+        first_pending_ns = now();
+        ready.notify_one();
+      } else if (pending_records == batch){
+        ready.notify_one();
+      }
+    }
+
+    // True when drivers must hold results until durable_sequence() covers them.
+    bool holds_results() const {
+      return mode == JOURNAL_SYNC;
+    }
+
+    // Sequence number of the last record appended.
+    uint64_t sequence(){
+      std::lock_guard<std::mutex> lock(mutex);
+      return last_sequence;
+    }
+
+    // Highest sequence number written (and synced, except in async mode).
+    uint64_t durable_sequence() const {
+      return durable.load(std::memory_order_acquire);
+    }
+
+    // Blocks until `sequence` is durable; false if the journal failed.
+    bool wait_durable(uint64_t sequence){
+      std::unique_lock<std::mutex> lock(mutex);
+      if (pending_records > 0){
+        first_pending_ns = 0;
+        ready.notify_one();
+      }
+      committed.wait(lock, [&]() { return failed || durable.load(std::memory_order_relaxed) >= sequence; });
+      return !failed;
+    }
+
+    bool ok(){
+      std::lock_guard<std::mutex> lock(mutex);
+      return !failed;
+    }
+
+    // Writes out everything pending and stops the writer thread.
+    void close(){
+      if (fd < 0){
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        ready.notify_one();
+      }
+      writer.join();
+      ::close(fd);
+      fd = -1;
+    }
+private:
+    static uint64_t now(){
+      return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void write_groups(){
+      std::string writing;
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true){
+        if (active.empty()){
+          if (stopping){
+            break;
+          }
+          ready.wait(lock);
+          continue;
+        }
+        uint64_t deadline = first_pending_ns + interval_us;
+        if (!stopping && pending_records > 0 && pending_records < batch && now() < deadline){
+          ready.wait_for(lock, std::chrono::microseconds(deadline - now()));
+          continue;
+        }
+        writing.swap(active);
+        uint64_t group_sequence = last_sequence;
+        pending_records = 0;
+        lock.unlock();
+        bool written = write_all(writing.data(), writing.size()) && (mode == JOURNAL_ASYNC || fdatasync(fd) == 0);
+        if (!written){
+          std::cerr << "journal write failed: " << strerror(errno) << std::endl;
+        }
+        writing.clear();
+        lock.lock();
+        if (!written){
+          failed = true;
+          active.clear();
+        } else {
+          durable.store(group_sequence, std::memory_order_release);
+        }
+        committed.notify_all();
+      }
+    }
+
+    bool write_all(const char* data, size_t length){
+      while (length > 0){
+        ssize_t count = ::write(fd, data, length);
+        if (count < 0 && errno == EINTR){
+          continue;
+        }
+        if (count <= 0){
+          return false;
+        }
+        data += count;
+        length -= count;
+      }
+      return true;
+    }
+
+    int fd;
+    journal_mode_t mode;
+    uint64_t interval_us;
+    size_t batch;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable committed;
+    std::thread writer;
+    std::string active;
+    std::string payload;
+    uint64_t last_sequence;
+    uint64_t previous_ns;
+    size_t pending_records;
+    uint64_t first_pending_ns;
+    bool stopping;
+    bool failed;
+    std::atomic<uint64_t> durable;
+};
+
+#endif
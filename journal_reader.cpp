@@ -0,0 +1,60 @@
+// Prints a SimpleCross journal (see journal.h).
+//
+//     ./journal_reader FILE [--actions]
+//
+// By default every record is printed as its sequence number, time and action
+// line followed by its results, indented. --actions prints only the action
+// lines, which can be fed back to simple_cross with "--input -". A summary
+// goes to stderr; the exit status is 1 if the journal ends in a torn record.
+#include <string>
+#include <cstdio>
+#include <iostream>
+
+#include "journal.h"
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || (argc == 3 && std::string(argv[2]) != "--actions") || argc > 3){
+        std::cerr << "usage: " << argv[0] << " FILE [--actions]" << std::endl;
+        return 1;
+    }
+    bool actions_only = argc == 3;
+    journal_reader_t reader;
+    std::string error;
+    if (!reader.open(argv[1], error)){
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    journal_entry_t entry;
+    uint64_t records = 0, results = 0;
+    std::string out;
+    while (reader.next(entry)){
+        records++;
+        results += entry.results.size();
+        if (actions_only){
+            out += entry.action;
+            out += '\n';
+        } else {
+            char prefix[64];
+            snprintf(prefix, sizeof(prefix), "%llu %llu.%09llu ", (unsigned long long)entry.sequence,
+                     (unsigned long long)(entry.time_ns / 1000000000), (unsigned long long)(entry.time_ns % 1000000000));
+            out += prefix;
+            out += entry.action;
+            out += '\n';
+            for (const std::string& result : entry.results){
+                out += "    ";
+                out += result;
+                out += '\n';
+            }
+        }
+        if (out.size() > 64 * 1024){
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+    std::cerr << records << " records, " << results << " results, " << reader.valid_bytes() << " bytes"
+              << (reader.torn_tail() ? ", torn record at the tail" : "") << std::endl;
+    return reader.torn_tail() ? 1 : 0;
+}
@@ -0,0 +1,112 @@
+/*
+Log-linear latency histogram in the style of HdrHistogram.
+
+Values below 2^SUB_BITS get a bucket each; above that every power of two is
+split into 2^SUB_BITS equal buckets, so a recorded value is known to within
+1/2^SUB_BITS (about 3%) of itself over the whole 64-bit range with a fixed
+array of counters. Recording is a count-leading-zeros, a shift and an
+increment. Histograms with the same layout merge by adding counts, so each
+thread can record into its own and a reporter sums them.
+*/
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <time.h>
+
+class latency_histogram_t
+{
+public:
+    static const int SUB_BITS = 5;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    latency_histogram_t(){
+      clear();
+    }
+
+    void clear(){
+      memset(counts, 0, sizeof(counts));
+      total = 0;
+      largest = 0;
+    }
+
+    void record(uint64_t value){
+      counts[index(value)]++;
+      total++;
+      largest = value > largest ? value : largest;
+    }
+
+    void merge(const latency_histogram_t& other){
+      for (int i = 0; i < BUCKETS; i++){
+        counts[i] += other.counts[i];
+      }
+      total += other.total;
+      largest = other.largest > largest ? other.largest : largest;
+    }
+
+    uint64_t count() const {
+      return total;
+    }
+
+    uint64_t max() const {
+      return largest;
+    }
+
+    // Smallest value v such that at least `fraction` of the samples are <= v,
+    // to the bucket's resolution (the bucket's upper bound, capped at max()).
+    uint64_t percentile(double fraction) const {
+      uint64_t rank = (uint64_t)(fraction * total);
+      rank = rank < 1 ? 1 : rank;
+      uint64_t seen = 0;
+      for (int i = 0; i < BUCKETS; i++){
+        seen += counts[i];
+        if (seen >= rank){
+          uint64_t upper = highest_in(i);
+          return upper < largest ? upper : largest;
+        }
+      }
+      return largest;
+    }
+
+    // "count=N p50=.. p99=.. p99.9=.. max=.."
+    std::string summary() const {
+      char text[160];
+      snprintf(text, sizeof(text), "count=%llu p50=%llu p99=%llu p99.9=%llu max=%llu", (unsigned long long)total,
+               (unsigned long long)percentile(0.50), (unsigned long long)percentile(0.99),
+               (unsigned long long)percentile(0.999), (unsigned long long)largest);
+      return text;
+    }
+
+    static int index(uint64_t value){
+      if (value < (uint64_t)SUB_BUCKETS){
+        return (int)value;
+      }
+      int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+      return ((shift + 1) << SUB_BITS) + (int)((value >> shift) - SUB_BUCKETS);
+    }
+
+    static uint64_t highest_in(int index){
+      if (index < SUB_BUCKETS){
+        return index;
+      }
+      int shift = (index >> SUB_BITS) - 1;
+      uint64_t lowest = (uint64_t)(SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift;
+      return lowest + ((uint64_t)1 << shift) - 1;
+    }
+private:
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t largest;
+};
+
+inline uint64_t monotonic_ns(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#endif
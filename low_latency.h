@@ -0,0 +1,160 @@
+/*
+Building blocks for the busy-poll run mode.
+
+Tail latency of the matcher is dominated by scheduler wakeups and page faults
+rather than by the crossing logic, so in busy-poll mode:
+    * the ingest and matcher threads are pinned to dedicated cores
+    * all current and future memory is locked with mlockall and the heap is
+      pre-faulted so the hot path never takes a page fault
+    * input is read with non-blocking reads and handed to the matcher through
+      a single producer/single consumer ring; both sides spin instead of sleeping
+*/
+#ifndef LOW_LATENCY_H
+#define LOW_LATENCY_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+// Longest action line carried through the ring; longer lines are rejected.
+const size_t LINE_CAPACITY = 110;
+
+struct line_slot_t {
+  uint64_t enqueue_ns;
+  uint16_t length;
+  bool end_of_input;
+  bool truncated;
+  char data[LINE_CAPACITY];
+};
+
+// Lock-free single producer/single consumer ring. Head and tail live on
+// separate cache lines so producer and consumer do not false-share.
+template <size_t CAPACITY>
+class spsc_ring_t
+{
+public:
+    spsc_ring_t() : head(0), tail(0) {}
+
+    // Returns a slot to fill, or NULL if the ring is full.
+    line_slot_t* claim(){
+      size_t position = tail.load(std::memory_order_relaxed);
+      if (position - head.load(std::memory_order_acquire) == CAPACITY){
+        return NULL;
+      }
+      return &slots[position % CAPACITY];
+    }
+
+    void publish(){
+      tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Returns the oldest filled slot, or NULL if the ring is empty.
+    line_slot_t* front(){
+      size_t position = head.load(std::memory_order_relaxed);
+      if (position == tail.load(std::memory_order_acquire)){
+        return NULL;
+      }
+      return &slots[position % CAPACITY];
+    }
+
+    void pop(){
+      head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Touch every slot so the ring itself is resident before the run starts.
+    void prefault(){
+      memset(slots, 0, sizeof(slots));
+    }
+private:
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    alignas(64) line_slot_t slots[CAPACITY];
+};
+
+inline uint64_t now_ns(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Pins the calling thread to the given core. A negative core leaves the
+// affinity untouched.
+inline bool pin_current_thread(int cpu, const char* name){
+  if (cpu < 0){
+    return true;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (rc != 0){
+    std::cerr << "warning: could not pin " << name << " thread to cpu " << cpu << ": " << strerror(rc) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Locks all current and future pages into RAM and stops glibc from handing
+// freed heap memory back to the kernel, so pages faulted in once stay mapped.
+inline bool lock_memory(){
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0){
+    std::cerr << "warning: mlockall failed: " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Grows the heap by roughly `bytes` and touches every page, then releases the
+// block back to malloc. With trimming disabled the pages stay resident and are
+// reused by the engine's allocations instead of being faulted in on demand.
+inline void prefault_heap(size_t bytes){
+  const size_t chunk = 64 * 1024;
+  std::vector<char*> blocks;
+  blocks.reserve(bytes / chunk + 1);
+  for (size_t done = 0; done < bytes; done += chunk){
+    char* block = static_cast<char*>(malloc(chunk));
+    if (block == NULL){
+      break;
+    }
+    memset(block, 0, chunk);
+    blocks.push_back(block);
+  }
+  for (char* block : blocks){
+    free(block);
+  }
+}
+
+// Prints count, p50, p99, p99.9 and max of the samples (in nanoseconds) to stderr.
+inline void report_latency(const char* mode, std::vector<uint64_t>& samples){
+  if (samples.empty()){
+    std::cerr << mode << " latency: no samples" << std::endl;
+    return;
+  }
+  std::sort(samples.begin(), samples.end());
+  size_t count = samples.size();
+  std::cerr << mode << " latency (ns): count=" << count
+            << " p50=" << samples[count * 50 / 100]
+            << " p99=" << samples[count * 99 / 100]
+            << " p99.9=" << samples[count * 999 / 1000]
+            << " max=" << samples[count - 1] << std::endl;
+}
+
+#endif
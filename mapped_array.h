@@ -0,0 +1,190 @@
+/*
+Growable arrays of plain structs kept in a memory mapping that is either
+anonymous (the default) or backed by a file.
+
+A file-backed array outlives the process. The file is a 64-byte header
+(magic, element size, count, capacity and four words the owner uses for its
+own scalars) followed by the elements, mapped MAP_SHARED: every store is in
+the page cache as soon as it is made and the kernel writes it back, so a
+process crash loses nothing and a power loss what was not yet written back
+(sync() forces it out). Growth doubles the capacity with ftruncate and
+mremap. The mapping may move, so elements must refer to each other by index,
+never by address.
+*/
+#ifndef MAPPED_ARRAY_H
+#define MAPPED_ARRAY_H
+
+#include <string>
+#include <new>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const uint64_t MAPPED_ARRAY_MAGIC = 0x5941525241584353ULL;
+const uint32_t MAPPED_ARRAY_VERSION = 1;
+
+struct mapped_array_header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t element_size;
+  uint64_t count;
+  uint64_t capacity;
+  uint64_t words[4];
+};
+
+template <typename T>
+class mapped_array_t
+{
+public:
+    mapped_array_t() : header(NULL), items(NULL), fd(-1) {
+      void* memory = mmap(NULL, bytes_for(16), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (memory == MAP_FAILED){
+        throw std::bad_alloc();
+      }
+      attach(memory);
+      *header = mapped_array_header_t{MAPPED_ARRAY_MAGIC, MAPPED_ARRAY_VERSION, sizeof(T), 0, 16, {0, 0, 0, 0}};
+    }
+
+    ~mapped_array_t(){
+      munmap(header, bytes_for(header->capacity));
+      if (fd >= 0){
+        close(fd);
+      }
+    }
+
+    mapped_array_t(const mapped_array_t&) = delete;
+    mapped_array_t& operator=(const mapped_array_t&) = delete;
+
+    // Moves the array into the file at path. A missing or empty file is
+    // created with the current contents; an existing one is attached and
+    // its contents replace the current ones.
+    bool open(const std::string& path, bool& created, std::string& error){
+      int file = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+      struct stat info;
+      if (file < 0 || fstat(file, &info) != 0){
+        error = "Cannot open " + path + ": " + strerror(errno);
+        if (file >= 0) close(file);
+        return false;
+      }
+      created = info.st_size == 0;
+      size_t size = created ? bytes_for(header->capacity) : info.st_size;
+      if ((created && ftruncate(file, size) != 0) || size < sizeof(mapped_array_header_t)){
+        error = "Cannot size " + path + ": " + (created ? strerror(errno) : "file too short");
+        close(file);
+        return false;
+      }
+      void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+      if (memory == MAP_FAILED){
+        error = "Cannot map " + path + ": " + strerror(errno);
+        close(file);
+        return false;
+      }
+      mapped_array_header_t* mapped = static_cast<mapped_array_header_t*>(memory);
+      if (created){
+        memcpy(memory, header, bytes_for(header->count));
+      } else if (mapped->magic != MAPPED_ARRAY_MAGIC || mapped->version != MAPPED_ARRAY_VERSION
+                 || mapped->element_size != sizeof(T) || mapped->count > mapped->capacity
+                 || bytes_for(mapped->capacity) != size){
+        error = "File " + path + " is not a matching SimpleCross book file";
+        munmap(memory, size);
+        close(file);
+        return false;
+      }
+      munmap(header, bytes_for(header->capacity));
+      if (fd >= 0){
+        close(fd);
+      }
+      fd = file;
+      attach(memory);
+      return true;
+    }
+
+    size_t size() const {
+      return header->count;
+    }
+
+    size_t capacity() const {
+      return header->capacity;
+    }
+
+    T& operator[](size_t index){
+      return items[index];
+    }
+
+    const T& operator[](size_t index) const {
+      return items[index];
+    }
+
+    T* begin() const {
+      return items;
+    }
+
+    T* end() const {
+      return items + header->count;
+    }
+
+    void push_back(const T& value){
+      if (header->count == header->capacity){
+        grow(header->capacity * 2);
+      }
+      items[header->count++] = value;
+    }
+
+    // Sets the size to count, filling new elements with value.
+    void resize(size_t count, const T& value){
+      reserve(count);
+      for (size_t i = header->count; i < count; i++){
+        items[i] = value;
+      }
+      header->count = count;
+    }
+
+    void reserve(size_t capacity){
+      if (capacity > header->capacity){
+        grow(capacity);
+      }
+    }
+
+    // Scalars kept next to the elements (and persisted with them).
+    uint64_t& word(int index){
+      return header->words[index];
+    }
+
+    // Writes a file-backed array back to disk.
+    bool sync(){
+      return fd < 0 || msync(header, bytes_for(header->capacity), MS_SYNC) == 0;
+    }
+private:
+    static size_t bytes_for(size_t capacity){
+      return sizeof(mapped_array_header_t) + capacity * sizeof(T);
+    }
+
+    void attach(void* memory){
+      header = static_cast<mapped_array_header_t*>(memory);
+      items = reinterpret_cast<T*>(header + 1);
+    }
+
+    void grow(size_t capacity){
+      size_t old_size = bytes_for(header->capacity);
+      size_t new_size = bytes_for(capacity);
+      if (fd >= 0 && ftruncate(fd, new_size) != 0){
+        throw std::bad_alloc();
+      }
+      void* memory = mremap(header, old_size, new_size, MREMAP_MAYMOVE);
+      if (memory == MAP_FAILED){
+        throw std::bad_alloc();
+      }
+      attach(memory);
+      header->capacity = capacity;
+    }
+
+    mapped_array_header_t* header;
+    T* items;
+    int fd;
+};
+
+#endif
@@ -0,0 +1,350 @@
+/*
+Market data output stage for SimpleCross.
+
+md_publisher_t observes the engine's book (book_listener_t) and publishes
+sequenced, binary, incremental price level updates over UDP multicast:
+
+    packet   = md_packet_header_t followed by `count` md_message_t
+    messages = ADD_LEVEL / MODIFY_LEVEL / DELETE_LEVEL carrying the level's new
+               aggregate quantity and order count, TRADE carrying the traded
+               quantity and price, END_OF_SESSION when the publisher stops
+
+Every message has its own sequence number; a packet header carries the number
+of its first message, so a consumer detects a gap as soon as a header skips
+ahead of the next expected number. All messages of one action() go out in the
+same packet where they fit.
+
+Recovery uses a unicast snapshot side channel: a consumer sends a header with
+MD_SNAPSHOT_REQUEST to the publisher's snapshot port (multicast port + 1 on the
+publishing interface) and receives the full level book as SNAPSHOT_LEVEL
+messages followed by SNAPSHOT_END, in packets flagged MD_SNAPSHOT whose header
+sequence is the last incremental message the snapshot includes. The qty of
+SNAPSHOT_END is the number of levels sent, so a consumer can tell a complete
+snapshot from one that lost a packet. Requests are answered between actions
+and, while no actions arrive, from the run mode's wait for input, so a
+consumer can recover from an idle engine.
+
+All fields are in host (little-endian) byte order.
+*/
+#ifndef MARKET_DATA_H
+#define MARKET_DATA_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <unordered_map>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "simple_cross.h"
+
+const uint32_t MD_MAGIC = 0x5843444d;
+const uint16_t MD_SNAPSHOT = 1;
+const uint16_t MD_SNAPSHOT_REQUEST = 2;
+const size_t MD_MAX_MESSAGES = 40;
+const int MD_SNAPSHOT_POLL_MS = 1;
+const int MD_LINGER_MS = 500;
+
+enum md_message_type_t {
+  MD_ADD_LEVEL = 'A',
+  MD_MODIFY_LEVEL = 'M',
+  MD_DELETE_LEVEL = 'D',
+  MD_TRADE = 'T',
+  MD_END_OF_SESSION = 'E',
+  MD_SNAPSHOT_LEVEL = 'S',
+  MD_SNAPSHOT_END = 'Z'
+};
+
+struct md_packet_header_t {
+  uint32_t magic;
+  uint16_t count;
+  uint16_t flags;
+  uint64_t sequence;
+};
+
+struct md_message_t {
+  char type;
+  char side;            // 'B' or 'S', 0 for trades and session messages
+  uint16_t reserved;
+  uint32_t orders;      // orders resting at the level after the change
+  uint32_t qty;         // level quantity after the change, or traded quantity
+  uint32_t reserved2;
+  double px;
+  char symbol[8];       // NUL padded
+};
+
+struct md_level_t {
+  uint32_t qty;
+  uint32_t orders;
+};
+
+typedef std::map<double, md_level_t> md_side_t;
+typedef std::unordered_map<std::string, std::pair<md_side_t, md_side_t> > md_book_t;
+
+inline md_side_t& md_book_side(md_book_t& book, const std::string& symbol, char side){
+  return side == 'B' ? book[symbol].first : book[symbol].second;
+}
+
+inline std::string md_symbol(const md_message_t& message){
+  return std::string(message.symbol, strnlen(message.symbol, sizeof(message.symbol)));
+}
+
+// Applies a level message (incremental or snapshot) to a level book.
+inline void md_apply(md_book_t& book, const md_message_t& message){
+  md_side_t& levels = md_book_side(book, md_symbol(message), message.side);
+  switch (message.type){
+    case MD_ADD_LEVEL:
+    case MD_MODIFY_LEVEL:
+    case MD_SNAPSHOT_LEVEL:
+      levels[message.px].qty = message.qty;
+      levels[message.px].orders = message.orders;
+      break;
+    case MD_DELETE_LEVEL:
+      levels.erase(message.px);
+      break;
+  }
+}
+
+// Parses "A.B.C.D:PORT" into an IPv4 socket address.
+inline bool md_parse_address(const std::string& address, struct sockaddr_in& out){
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos){
+    return false;
+  }
+  memset(&out, 0, sizeof(out));
+  out.sin_family = AF_INET;
+  out.sin_port = htons(std::atoi(address.c_str() + colon + 1));
+  return inet_pton(AF_INET, address.substr(0, colon).c_str(), &out.sin_addr) == 1 && out.sin_port != 0;
+}
+
+inline uint64_t md_now_ms(){
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class md_publisher_t : public book_listener_t
+{
+public:
+    md_publisher_t() : feed_fd(-1), snapshot_fd(-1), next_sequence(1), last_poll_ms(0) {}
+
+    ~md_publisher_t(){
+      if (feed_fd >= 0) close(feed_fd);
+      if (snapshot_fd >= 0) close(snapshot_fd);
+    }
+
+    // Opens the multicast feed "GROUP:PORT" on the interface with address
+    // `interface` and the snapshot socket on interface:PORT+1.
+    bool open(const std::string& group, const std::string& interface, std::string& error){
+      struct in_addr local;
+      if (!md_parse_address(group, feed_address) || inet_pton(AF_INET, interface.c_str(), &local) != 1){
+        error = "Invalid market data address " + group + " on " + interface;
+        return false;
+      }
+      feed_fd = socket(AF_INET, SOCK_DGRAM, 0);
+      unsigned char loop = 1, ttl = 1;
+      if (feed_fd < 0
+          || setsockopt(feed_fd, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) != 0
+          || setsockopt(feed_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) != 0
+          || setsockopt(feed_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0){
+        error = std::string("Cannot open market data socket: ") + strerror(errno);
+        return false;
+      }
+      struct sockaddr_in snapshot_address;
+      memset(&snapshot_address, 0, sizeof(snapshot_address));
+      snapshot_address.sin_family = AF_INET;
+      snapshot_address.sin_addr = local;
+      snapshot_address.sin_port = htons(ntohs(feed_address.sin_port) + 1);
+      snapshot_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+      if (snapshot_fd < 0 || bind(snapshot_fd, (struct sockaddr*)&snapshot_address, sizeof(snapshot_address)) != 0){
+        error = std::string("Cannot bind market data snapshot socket: ") + strerror(errno);
+        return false;
+      }
+      return true;
+    }
+
+    // Seeds the level book with the orders already resting in `engine`
+    // (mapped or recovered at startup) without publishing them; consumers
+    // learn them from a snapshot. Call before attaching the publisher.
+    void load_book(SimpleCross& engine){
+      engine.for_each_order([this](int oid, const std::string& symbol, char side, double px, int qty, bool live){
+        if (live){
+          md_level_t& level = md_book_side(levels, symbol, side)[px];
+          level.qty += qty;
+          level.orders++;
+        }
+      });
+    }
+
+    void order_added(const std::string& symbol, char side, int oid, double px, int qty){
+      md_level_t& level = md_book_side(levels, symbol, side)[px];
+      level.qty += qty;
+      level.orders++;
+      publish(level.orders == 1 ? MD_ADD_LEVEL : MD_MODIFY_LEVEL, symbol, side, px, level);
+    }
+
+    void order_modified(const std::string& symbol, char side, int oid, double px, int old_qty, int qty){
+      md_level_t& level = md_book_side(levels, symbol, side)[px];
+      level.qty += qty - old_qty;
+      publish(MD_MODIFY_LEVEL, symbol, side, px, level);
+    }
+
+    void order_removed(const std::string& symbol, char side, int oid, double px, int qty){
+      md_side_t& book_side = md_book_side(levels, symbol, side);
+      md_level_t& level = book_side[px];
+      level.qty -= qty;
+      level.orders--;
+      if (level.orders == 0){
+        publish(MD_DELETE_LEVEL, symbol, side, px, level);
+        book_side.erase(px);
+      } else {
+        publish(MD_MODIFY_LEVEL, symbol, side, px, level);
+      }
+    }
+
+    void trade(const std::string& symbol, double px, int qty){
+      md_level_t traded = {(uint32_t)qty, 0};
+      publish(MD_TRADE, symbol, 0, px, traded);
+    }
+
+    // Sends this action's messages and, at most every MD_SNAPSHOT_POLL_MS,
+    // answers pending snapshot requests.
+    void action_done(){
+      flush();
+      poll_snapshots();
+    }
+
+    // Answers pending snapshot requests at most every MD_SNAPSHOT_POLL_MS;
+    // cheap enough for a run loop's idle spin.
+    void poll_snapshots(){
+      uint64_t now = md_now_ms();
+      if (now - last_poll_ms >= (uint64_t)MD_SNAPSHOT_POLL_MS){
+        last_poll_ms = now;
+        serve_snapshots();
+      }
+    }
+
+    // Answers every queued snapshot request with the current level book.
+    // Event loops that wait on snapshot_socket() call this when it is
+    // readable, so requests are answered while no actions arrive.
+    void serve_snapshots(){
+      char request[sizeof(md_packet_header_t)];
+      struct sockaddr_in requester;
+      socklen_t requester_length = sizeof(requester);
+      while (recvfrom(snapshot_fd, request, sizeof(request), 0, (struct sockaddr*)&requester, &requester_length) == (ssize_t)sizeof(request)){
+        md_packet_header_t header;
+        memcpy(&header, request, sizeof(header));
+        if (header.magic == MD_MAGIC && header.flags == MD_SNAPSHOT_REQUEST){
+          send_snapshot(requester);
+        }
+        requester_length = sizeof(requester);
+      }
+    }
+
+    // The non-blocking socket snapshot requests arrive on, -1 before open().
+    int snapshot_socket() const {
+      return snapshot_fd;
+    }
+
+    // Publishes END_OF_SESSION, then keeps answering snapshot requests for
+    // MD_LINGER_MS so consumers still recovering can complete.
+    void end_session(){
+      md_level_t none = {0, 0};
+      publish(MD_END_OF_SESSION, "", 0, 0.0, none);
+      flush();
+      uint64_t deadline = md_now_ms() + MD_LINGER_MS;
+      uint64_t now;
+      while ((now = md_now_ms()) < deadline){
+        struct pollfd readable = {snapshot_fd, POLLIN, 0};
+        if (poll(&readable, 1, deadline - now) > 0){
+          serve_snapshots();
+        }
+      }
+    }
+private:
+    void publish(char type, const std::string& symbol, char side, double px, const md_level_t& level){
+      md_message_t message;
+      fill_message(message, type, symbol, side, px, level);
+      pending.push_back(message);
+      if (pending.size() == MD_MAX_MESSAGES){
+        flush();
+      }
+    }
+
+    static void fill_message(md_message_t& message, char type, const std::string& symbol, char side, double px, const md_level_t& level){
+      memset(&message, 0, sizeof(message));
+      message.type = type;
+      message.side = side;
+      message.orders = level.orders;
+      message.qty = level.qty;
+      message.px = px;
+      memcpy(message.symbol, symbol.data(), std::min(symbol.size(), sizeof(message.symbol)));
+    }
+
+    void flush(){
+      if (pending.empty()){
+        return;
+      }
+      send_packet(feed_address, 0, next_sequence, pending);
+      next_sequence += pending.size();
+      pending.clear();
+    }
+
+    void send_packet(const struct sockaddr_in& destination, uint16_t flags, uint64_t sequence, const std::vector<md_message_t>& messages){
+      char packet[sizeof(md_packet_header_t) + MD_MAX_MESSAGES * sizeof(md_message_t)];
+      md_packet_header_t header = {MD_MAGIC, (uint16_t)messages.size(), flags, sequence};
+      memcpy(packet, &header, sizeof(header));
+      memcpy(packet + sizeof(header), messages.data(), messages.size() * sizeof(md_message_t));
+      int fd = flags & MD_SNAPSHOT ? snapshot_fd : feed_fd;
+      size_t length = sizeof(header) + messages.size() * sizeof(md_message_t);
+      while (sendto(fd, packet, length, 0, (const struct sockaddr*)&destination, sizeof(destination)) < 0){
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ENOBUFS){
+          break;
+        }
+        struct pollfd writable = {fd, POLLOUT, 0};
+        poll(&writable, 1, 10);
+      }
+    }
+
+    void send_snapshot(const struct sockaddr_in& requester){
+      uint64_t as_of = next_sequence - 1;
+      std::vector<md_message_t> messages;
+      md_message_t message;
+      uint32_t sent = 0;
+      for (md_book_t::const_iterator book = levels.begin(); book != levels.end(); ++book){
+        const md_side_t* sides[2] = {&book->second.first, &book->second.second};
+        for (int i = 0; i < 2; i++){
+          for (md_side_t::const_iterator level = sides[i]->begin(); level != sides[i]->end(); ++level){
+            fill_message(message, MD_SNAPSHOT_LEVEL, book->first, i == 0 ? 'B' : 'S', level->first, level->second);
+            messages.push_back(message);
+            sent++;
+            if (messages.size() == MD_MAX_MESSAGES){
+              send_packet(requester, MD_SNAPSHOT, as_of, messages);
+              messages.clear();
+            }
+          }
+        }
+      }
+      md_level_t total = {sent, 0};
+      fill_message(message, MD_SNAPSHOT_END, "", 0, 0.0, total);
+      messages.push_back(message);
+      send_packet(requester, MD_SNAPSHOT, as_of, messages);
+    }
+
+    int feed_fd;
+    int snapshot_fd;
+    struct sockaddr_in feed_address;
+    uint64_t next_sequence;
+    uint64_t last_poll_ms;
+    std::vector<md_message_t> pending;
+    md_book_t levels;
+};
+
+#endif
@@ -0,0 +1,318 @@
+// Market data listener for the multicast feed (see market_data.h).
+//
+//     ./md_listener GROUP:PORT [--interface ADDR] [--check FILE] [--drop N]
+//
+// Joins the feed, starts from a snapshot (a restarted engine may already
+// hold a book), rebuilds the price level book from incremental messages,
+// detects sequence gaps and recovers through the snapshot channel, and stops
+// at END_OF_SESSION. With --check the rebuilt book is compared against the
+// book of a local SimpleCross fed with the same actions file. --drop N
+// discards every Nth feed packet to exercise gap recovery on loopback.
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "simple_cross.h"
+#include "market_data.h"
+
+const int SNAPSHOT_RETRY_MS = 200;
+const int IDLE_TIMEOUT_MS = 10000;
+
+class md_listener_t
+{
+public:
+    md_listener_t() : feed_fd(-1), snapshot_fd(-1), expected(1), recovering(true), finished(false),
+                      drop_every(0), packets(0), messages(0), gaps(0), snapshots(0), last_request_ms(0) {}
+
+    bool open(const std::string& group, const std::string& interface, std::string& error){
+      struct sockaddr_in feed;
+      struct in_addr local;
+      if (!md_parse_address(group, feed) || inet_pton(AF_INET, interface.c_str(), &local) != 1){
+        error = "Invalid market data address " + group + " on " + interface;
+        return false;
+      }
+      feed_fd = socket(AF_INET, SOCK_DGRAM, 0);
+      int one = 1;
+      struct ip_mreq membership;
+      membership.imr_multiaddr = feed.sin_addr;
+      membership.imr_interface = local;
+      if (feed_fd < 0
+          || setsockopt(feed_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+          || bind(feed_fd, (struct sockaddr*)&feed, sizeof(feed)) != 0
+          || setsockopt(feed_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0){
+        error = std::string("Cannot join ") + group + ": " + strerror(errno);
+        return false;
+      }
+      memset(&snapshot_address, 0, sizeof(snapshot_address));
+      snapshot_address.sin_family = AF_INET;
+      snapshot_address.sin_addr = local;
+      snapshot_address.sin_port = htons(ntohs(feed.sin_port) + 1);
+      snapshot_fd = socket(AF_INET, SOCK_DGRAM, 0);
+      if (snapshot_fd < 0){
+        error = std::string("Cannot open snapshot socket: ") + strerror(errno);
+        return false;
+      }
+      return true;
+    }
+
+    // Requests the initial snapshot, then receives until END_OF_SESSION or
+    // IDLE_TIMEOUT_MS without traffic.
+    bool run(int drop){
+      drop_every = drop;
+      char packet[sizeof(md_packet_header_t) + MD_MAX_MESSAGES * sizeof(md_message_t)];
+      request_snapshot();
+      uint64_t last_traffic_ms = md_now_ms();
+      while (!finished){
+        struct pollfd sockets[2] = {{feed_fd, POLLIN, 0}, {snapshot_fd, POLLIN, 0}};
+        int ready = poll(sockets, 2, recovering ? SNAPSHOT_RETRY_MS : IDLE_TIMEOUT_MS);
+        if (ready > 0){
+          last_traffic_ms = md_now_ms();
+        } else if (md_now_ms() - last_traffic_ms >= (uint64_t)IDLE_TIMEOUT_MS){
+          std::cerr << "no market data for " << IDLE_TIMEOUT_MS << " ms" << std::endl;
+          return false;
+        }
+        for (int i = 0; i < 2; i++){
+          if (!(sockets[i].revents & POLLIN)){
+            continue;
+          }
+          ssize_t length = recv(sockets[i].fd, packet, sizeof(packet), 0);
+          if (length >= (ssize_t)sizeof(md_packet_header_t)){
+            received(packet, length, i == 1);
+          }
+        }
+        if (recovering && md_now_ms() - last_request_ms >= (uint64_t)SNAPSHOT_RETRY_MS){
+          request_snapshot();
+        }
+      }
+      return true;
+    }
+
+    void report(){
+      size_t levels = 0;
+      for (md_book_t::const_iterator it = book.begin(); it != book.end(); ++it){
+        levels += it->second.first.size() + it->second.second.size();
+      }
+      std::cout << "packets " << packets << ", messages " << messages << ", gaps " << gaps
+                << ", snapshots " << snapshots << ", levels " << levels << std::endl;
+    }
+
+    const md_book_t& rebuilt_book() const {
+      return book;
+    }
+private:
+    void received(const char* packet, size_t length, bool snapshot_channel){
+      md_packet_header_t header;
+      memcpy(&header, packet, sizeof(header));
+      if (header.magic != MD_MAGIC || length != sizeof(header) + header.count * sizeof(md_message_t)){
+        return;
+      }
+      std::vector<md_message_t> body(header.count);
+      memcpy(body.data(), packet + sizeof(header), header.count * sizeof(md_message_t));
+      if (snapshot_channel){
+        snapshot_packet(header, body);
+        return;
+      }
+      packets++;
+      if (drop_every > 0 && packets % drop_every == 0){
+        return;
+      }
+      if (recovering){
+        buffered.push_back(std::make_pair(header, body));
+        return;
+      }
+      incremental(header, body);
+    }
+
+    // Applies the messages of a feed packet that are next in sequence; a
+    // packet starting past the expected number starts recovery.
+    void incremental(const md_packet_header_t& header, const std::vector<md_message_t>& body){
+      if (header.sequence + body.size() <= expected){
+        // Already covered by a snapshot, which may have included the end of
+        // the session.
+        finished = finished || (!body.empty() && body.back().type == MD_END_OF_SESSION);
+        return;
+      }
+      if (header.sequence > expected){
+        gaps++;
+        recovering = true;
+        buffered.push_back(std::make_pair(header, body));
+        request_snapshot();
+        return;
+      }
+      for (size_t i = expected - header.sequence; i < body.size(); i++){
+        messages++;
+        if (body[i].type == MD_END_OF_SESSION){
+          finished = true;
+        } else if (body[i].type != MD_TRADE){
+          md_apply(book, body[i]);
+        }
+      }
+      expected = header.sequence + body.size();
+    }
+
+    void request_snapshot(){
+      md_packet_header_t request = {MD_MAGIC, 0, MD_SNAPSHOT_REQUEST, 0};
+      sendto(snapshot_fd, &request, sizeof(request), 0, (struct sockaddr*)&snapshot_address, sizeof(snapshot_address));
+      last_request_ms = md_now_ms();
+      snapshot_book.clear();
+      snapshot_levels = 0;
+    }
+
+    void snapshot_packet(const md_packet_header_t& header, const std::vector<md_message_t>& body){
+      if (!recovering || !(header.flags & MD_SNAPSHOT)){
+        return;
+      }
+      if (snapshot_levels == 0 || header.sequence != snapshot_as_of){
+        snapshot_book.clear();
+        snapshot_levels = 0;
+        snapshot_as_of = header.sequence;
+      }
+      for (const md_message_t& message : body){
+        if (message.type == MD_SNAPSHOT_LEVEL){
+          md_apply(snapshot_book, message);
+          snapshot_levels++;
+        } else if (message.type == MD_SNAPSHOT_END){
+          if (message.qty == snapshot_levels){
+            recovered();
+          } else {
+            request_snapshot();
+          }
+          return;
+        }
+      }
+    }
+
+    // Installs a complete snapshot and replays the feed packets buffered
+    // while it was requested.
+    void recovered(){
+      snapshots++;
+      book.swap(snapshot_book);
+      snapshot_book.clear();
+      expected = snapshot_as_of + 1;
+      recovering = false;
+      std::vector<std::pair<md_packet_header_t, std::vector<md_message_t> > > replay;
+      replay.swap(buffered);
+      for (size_t i = 0; i < replay.size(); i++){
+        if (recovering){
+          buffered.push_back(replay[i]);
+        } else {
+          incremental(replay[i].first, replay[i].second);
+        }
+      }
+    }
+
+    int feed_fd;
+    int snapshot_fd;
+    struct sockaddr_in snapshot_address;
+    uint64_t expected;
+    bool recovering;
+    bool finished;
+    int drop_every;
+    size_t packets, messages, gaps, snapshots;
+    uint64_t last_request_ms;
+    md_book_t book;
+    md_book_t snapshot_book;
+    uint32_t snapshot_levels;
+    uint64_t snapshot_as_of;
+    std::vector<std::pair<md_packet_header_t, std::vector<md_message_t> > > buffered;
+};
+
+// Builds the level book of a local engine fed with the actions file, from
+// its P output.
+bool engine_levels(const std::string& file, md_book_t& levels){
+  std::ifstream actions(file.c_str(), std::ios::in);
+  if (!actions){
+    return false;
+  }
+  SimpleCross scross;
+  std::string line;
+  while (std::getline(actions, line)){
+    scross.action(line);
+  }
+  results_t orders = scross.action("P");
+  for (const std::string& order : orders){
+    vlist_t split_order = scross.split(order, ' ');
+    md_level_t& level = md_book_side(levels, split_order[SYMBOL], split_order[SIDE][0])[std::stod(split_order[PX])];
+    level.qty += std::stoi(split_order[QTY]);
+    level.orders++;
+  }
+  return true;
+}
+
+// Compares two level books, ignoring symbols without levels; prints differences.
+bool same_levels(const md_book_t& expected, const md_book_t& actual){
+  bool same = true;
+  const md_book_t* books[2] = {&expected, &actual};
+  for (int b = 0; b < 2; b++){
+    for (md_book_t::const_iterator it = books[b]->begin(); it != books[b]->end(); ++it){
+      md_book_t::const_iterator other = books[1 - b]->find(it->first);
+      const md_side_t* sides[2] = {&it->second.first, &it->second.second};
+      for (int s = 0; s < 2; s++){
+        for (md_side_t::const_iterator level = sides[s]->begin(); level != sides[s]->end(); ++level){
+          const md_side_t* other_side = other == books[1 - b]->end() ? NULL : (s == 0 ? &other->second.first : &other->second.second);
+          md_side_t::const_iterator match;
+          if (other_side == NULL || (match = other_side->find(level->first)) == other_side->end()
+              || match->second.qty != level->second.qty || match->second.orders != level->second.orders){
+            same = false;
+            std::cout << (b == 0 ? "engine" : "feed") << " level " << it->first << " " << (s == 0 ? 'B' : 'S') << " "
+                      << level->first << " qty " << level->second.qty << " orders " << level->second.orders
+                      << (b == 0 ? " differs in feed" : " differs in engine") << std::endl;
+          }
+        }
+      }
+    }
+  }
+  return same;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2){
+        std::cerr << "usage: " << argv[0] << " GROUP:PORT [--interface ADDR] [--check FILE] [--drop N]" << std::endl;
+        return 1;
+    }
+    std::string interface = "127.0.0.1", check;
+    int drop = 0;
+    for (int i = 2; i + 1 < argc; i += 2){
+        std::string arg = argv[i];
+        if (arg == "--interface"){
+            interface = argv[i + 1];
+        } else if (arg == "--check"){
+            check = argv[i + 1];
+        } else if (arg == "--drop"){
+            drop = std::atoi(argv[i + 1]);
+        }
+    }
+    md_listener_t listener;
+    std::string error;
+    if (!listener.open(argv[1], interface, error)){
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    bool complete = listener.run(drop);
+    listener.report();
+    if (!complete){
+        return 1;
+    }
+    if (!check.empty()){
+        md_book_t expected;
+        if (!engine_levels(check, expected)){
+            std::cerr << "cannot read " << check << std::endl;
+            return 1;
+        }
+        if (!same_levels(expected, listener.rebuilt_book())){
+            std::cout << "rebuilt book does not match the engine" << std::endl;
+            return 1;
+        }
+        std::cout << "rebuilt book matches the engine" << std::endl;
+    }
+    return 0;
+}
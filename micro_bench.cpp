@@ -0,0 +1,283 @@
+// Micro-benchmarks of the engine's primitives in isolation.
+//
+//     ./micro_bench [--reps N] [--warmup N] [--filter TEXT]
+//
+// Every case times a batch of operations per repetition. After `warmup`
+// untimed repetitions (default 20), `reps` timed ones (default 200) give the
+// ns per operation of each repetition, summarised as min, median, mean,
+// p99, max and standard deviation. State a case needs (a book of a given
+// depth, the orders a cancel batch removes) is set up outside the timing.
+// --filter runs only the cases whose name contains TEXT.
+//
+// Text: split() (the old line splitter, still used by md_listener),
+// tokenize() (what the engine uses instead of split and merge), price
+// parse and format against strtod and snprintf. Book: resting an order,
+// cancelling it, killing a FOK order and partially filling a resting order
+// at several book depths through execute(), printing books of several sizes, finding the
+// best level and an arbitrary level of one side, and reading a symbol's BBO.
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include "simple_cross.h"
+
+struct micro_options_t {
+  size_t reps = 200;
+  size_t warmup = 20;
+  std::string filter;
+};
+
+// Keeps results observable so the compiler cannot drop the work.
+volatile uint64_t observed;
+
+// execute() sink that only counts bytes.
+struct byte_count_t {
+  void operator()(const char* text, size_t length){
+    bytes += length;
+  }
+  uint64_t bytes = 0;
+};
+
+void print_header(){
+  printf("%-34s %8s %9s %9s %9s %9s %9s %9s\n", "case (ns/op)", "batch", "min", "median", "mean", "p99", "max", "stddev");
+}
+
+// Runs setup(rep) untimed and body(rep) timed for warmup + reps repetitions
+// and prints the summary of the timed ones.
+void run_case(const micro_options_t& opts, const std::string& name, size_t batch,
+              const std::function<void(size_t)>& setup, const std::function<void(size_t)>& body){
+  if (!opts.filter.empty() && name.find(opts.filter) == std::string::npos){
+    return;
+  }
+  std::vector<double> samples;
+  for (size_t rep = 0; rep < opts.warmup + opts.reps; rep++){
+    setup(rep);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    body(rep);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (rep >= opts.warmup){
+      samples.push_back(ns / batch);
+    }
+  }
+  std::sort(samples.begin(), samples.end());
+  double mean = 0, variance = 0;
+  for (double sample : samples){
+    mean += sample;
+  }
+  mean /= samples.size();
+  for (double sample : samples){
+    variance += (sample - mean) * (sample - mean);
+  }
+  printf("%-34s %8zu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name.c_str(), batch, samples.front(),
+         samples[samples.size() / 2], mean, samples[std::min(samples.size() - 1, samples.size() * 99 / 100)],
+         samples.back(), std::sqrt(variance / samples.size()));
+}
+
+void no_setup(size_t){}
+
+std::string order_line(int oid, char side, int qty, int64_t px){
+  char line[96];
+  int length = snprintf(line, sizeof(line), "O %d IBM %c %d ", oid, side, qty);
+  char* p = line + length;
+  SimpleCross::put_price(p, px);
+  return std::string(line, p - line);
+}
+
+// Bids at 1000.00000 - k and asks at 1001.00000 + k (k < depth), one order
+// each; returns the next free order id.
+int build_book(SimpleCross& engine, int depth){
+  byte_count_t sink;
+  int oid = 1;
+  for (int k = 0; k < depth; k++){
+    std::string bid = order_line(oid++, 'B', 10, (1000 - k) * PX_SCALE);
+    std::string ask = order_line(oid++, 'S', 10, (1001 + k) * PX_SCALE);
+    engine.execute(bid.data(), bid.size(), sink);
+    engine.execute(ask.data(), ask.size(), sink);
+  }
+  return oid;
+}
+
+void text_cases(const micro_options_t& opts){
+  const size_t batch = 1000;
+  std::mt19937_64 random(7);
+  std::vector<std::string> lines, prices;
+  std::vector<int64_t> units;
+  for (size_t i = 0; i < batch; i++){
+    int64_t px = 100000 + random() % 100000000;
+    units.push_back(px);
+    lines.push_back(order_line(10000 + i, (i & 1) ? 'B' : 'S', 1 + random() % 100, px));
+    char text[32];
+    char* p = text;
+    SimpleCross::put_price(p, px);
+    prices.push_back(std::string(text, p - text));
+  }
+  SimpleCross engine;
+  run_case(opts, "split", batch, no_setup, [&](size_t){
+    for (const std::string& line : lines){
+      observed = observed + engine.split(line, ' ').size();
+    }
+  });
+  run_case(opts, "tokenize", batch, no_setup, [&](size_t){
+    const char* fields[SimpleCross::MAX_FIELDS];
+    size_t lengths[SimpleCross::MAX_FIELDS];
+    for (const std::string& line : lines){
+      observed = observed + SimpleCross::tokenize(line.data(), line.size(), fields, lengths);
+    }
+  });
+  run_case(opts, "price parse (parse_price)", batch, no_setup, [&](size_t){
+    int64_t px = 0;
+    for (const std::string& price : prices){
+      SimpleCross::parse_price(price.data(), price.size(), px);
+      observed = observed + px;
+    }
+  });
+  run_case(opts, "price parse (strtod)", batch, no_setup, [&](size_t){
+    for (const std::string& price : prices){
+      observed = observed + (uint64_t)strtod(price.c_str(), NULL);
+    }
+  });
+  run_case(opts, "price format (put_price)", batch, no_setup, [&](size_t){
+    char text[32];
+    for (int64_t px : units){
+      char* p = text;
+      SimpleCross::put_price(p, px);
+      observed = observed + (p - text);
+    }
+  });
+  run_case(opts, "price format (snprintf %.5f)", batch, no_setup, [&](size_t){
+    char text[32];
+    for (int64_t px : units){
+      observed = observed + snprintf(text, sizeof(text), "%.5f", (double)px / PX_SCALE);
+    }
+  });
+}
+
+void book_cases(const micro_options_t& opts){
+  const size_t batch = 1000;
+  const int depths[] = {1, 10, 100, 1000};
+  for (int depth : depths){
+    std::string suffix = " depth " + std::to_string(depth);
+    SimpleCross engine;
+    int next_oid = build_book(engine, depth);
+    std::mt19937_64 random(depth);
+    std::vector<std::string> adds, cancels;
+    byte_count_t sink;
+    // Rest `batch` bids at random existing levels, then cancel them.
+    auto prepare = [&](){
+      adds.clear();
+      cancels.clear();
+      for (size_t i = 0; i < batch; i++){
+        int oid = next_oid++;
+        adds.push_back(order_line(oid, 'B', 10, (1000 - (int64_t)(random() % depth)) * PX_SCALE));
+        cancels.push_back("X " + std::to_string(oid));
+      }
+    };
+    auto run = [&](const std::vector<std::string>& lines){
+      for (const std::string& line : lines){
+        engine.execute(line.data(), line.size(), sink);
+      }
+    };
+    run_case(opts, "book add" + suffix, batch, [&](size_t rep){
+      if (rep > 0){
+        run(cancels);
+      }
+      prepare();
+    }, [&](size_t){ run(adds); });
+    run(cancels);
+    run_case(opts, "book cancel" + suffix, batch, [&](size_t){
+      prepare();
+      run(adds);
+    }, [&](size_t){ run(cancels); });
+
+    // FOK buys that the asks inside their limit cannot fill: killed after a
+    // walk over the crossing levels, leaving the book as it was.
+    std::vector<std::string> fok;
+    run_case(opts, "book FOK kill" + suffix, batch, [&](size_t){
+      fok.clear();
+      for (size_t i = 0; i < batch; i++){
+        fok.push_back(order_line(next_oid++, 'B', 10 * depth - 5, (1001 + depth - 2) * PX_SCALE) + " FOK");
+      }
+    }, [&](size_t){ run(fok); });
+
+    // One large sell at the best ask; every buy of 1 partially fills it.
+    std::string large = order_line(next_oid++, 'S', 1000000000, 1001 * PX_SCALE);
+    std::string best = "X " + std::to_string(2);
+    engine.execute(best.data(), best.size(), sink);
+    engine.execute(large.data(), large.size(), sink);
+    std::vector<std::string> takers;
+    run_case(opts, "book partial fill" + suffix, batch, [&](size_t){
+      takers.clear();
+      for (size_t i = 0; i < batch; i++){
+        takers.push_back(order_line(next_oid++, 'B', 1, 1001 * PX_SCALE));
+      }
+    }, [&](size_t){ run(takers); });
+
+    side_book_t asks;
+    for (int k = depth - 1; k >= 0; k--){
+      asks.push_back(level_t{(1001 + k) * PX_SCALE, 10, 1, NO_ORDER, NO_ORDER});
+    }
+    std::vector<int64_t> targets;
+    for (size_t i = 0; i < batch; i++){
+      targets.push_back((1001 + (int64_t)(random() % depth)) * PX_SCALE);
+    }
+    run_case(opts, "best price" + suffix, batch, no_setup, [&](size_t){
+      for (size_t i = 0; i < batch; i++){
+        observed = observed + asks.back().px;
+      }
+    });
+    const std::string symbol = "IBM";
+    run_case(opts, "bbo lookup" + suffix, batch, no_setup, [&](size_t){
+      bbo_t top = bbo_t();
+      for (size_t i = 0; i < batch; i++){
+        engine.bbo(symbol, top);
+        observed = observed + top.ask_qty;
+      }
+    });
+    run_case(opts, "level lookup" + suffix, batch, no_setup, [&](size_t){
+      for (int64_t px : targets){
+        observed = observed + SimpleCross::find_level(asks, false, px)->px;
+      }
+    });
+  }
+  const int sizes[] = {10, 100, 1000, 10000};
+  for (int orders : sizes){
+    SimpleCross engine;
+    build_book(engine, orders / 2);
+    byte_count_t sink;
+    run_case(opts, "print book " + std::to_string(orders) + " orders", 10, no_setup, [&](size_t){
+      for (int i = 0; i < 10; i++){
+        engine.execute("P", 1, sink);
+      }
+    });
+    observed = observed + sink.bytes;
+  }
+}
+
+int main(int argc, char **argv)
+{
+    micro_options_t opts;
+    for (int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if (arg == "--reps" && i+1 < argc){
+            opts.reps = std::max(1L, std::strtol(argv[++i], NULL, 10));
+        } else if (arg == "--warmup" && i+1 < argc){
+            opts.warmup = std::max(0L, std::strtol(argv[++i], NULL, 10));
+        } else if (arg == "--filter" && i+1 < argc){
+            opts.filter = argv[++i];
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--reps N] [--warmup N] [--filter TEXT]" << std::endl;
+            return 1;
+        }
+    }
+    print_header();
+    text_cases(opts);
+    book_cases(opts);
+    return 0;
+}
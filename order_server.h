@@ -0,0 +1,492 @@
+/*
+Order entry server for SimpleCross.
+
+A single-threaded, non-blocking epoll event loop accepting any number of client
+connections over TCP or Unix domain sockets. Each connection speaks the same
+newline framed text protocol as actions.txt: one action per line in, one result
+per line out.
+
+Routing:
+    * results of an action go back to the session that sent it
+    * a fill for the passive (resting) order goes to the session that entered
+      that order, if it is still connected
+    * book deltas (L and B lines, see --deltas) describe the shared book, so
+      they go to every connected session, the sender included
+    * only the session that entered an order may cancel (X) or amend (R) it;
+      anyone else gets "E OID Order entered by another session". Orders
+      restored at startup have no known owner and are open to every session
+    * output for sessions that have disconnected is dropped
+    * a session with more than MAX_PENDING_OUTPUT bytes of unread output is
+      disconnected when a line it did not ask for (a fill or a book delta
+      caused by another session) is due, so a client that stops reading
+      cannot hold broadcast output in server memory without bound; its
+      orders stay in the book
+
+Endpoints are given as "tcp:PORT", "tcp:HOST:PORT" or "unix:PATH".
+*/
+#ifndef ORDER_SERVER_H
+#define ORDER_SERVER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <unordered_map>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "simple_cross.h"
+#include "journal.h"
+#include "market_data.h"
+
+// Destination passed to a router's send callback for a result that every
+// session receives.
+const uint64_t EVERY_SESSION = UINT64_MAX;
+
+// Longest line accepted from a client before the connection's input is discarded.
+const size_t MAX_LINE_LENGTH = 4096;
+
+// Unread output a session may hold before an unsolicited line disconnects it.
+const size_t MAX_PENDING_OUTPUT = 16 * 1024 * 1024;
+
+// Set from SIGINT/SIGTERM to stop the event loop.
+static volatile sig_atomic_t server_stop_requested = 0;
+
+inline void request_server_stop(int){
+  server_stop_requested = 1;
+}
+
+// Installs SIGINT/SIGTERM handlers without SA_RESTART so a blocking wait
+// returns EINTR, and ignores SIGPIPE so writes to closed peers fail with EPIPE.
+inline void install_server_signals(){
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_server_stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+}
+
+inline bool set_nonblocking(int fd){
+  int flags = fcntl(fd, F_GETFL);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Opens a non-blocking listening socket for "tcp:[HOST:]PORT" or "unix:PATH".
+// Returns -1 and fills error on failure.
+inline int open_listener(const std::string& endpoint, std::string& error){
+  int fd = -1;
+  if (endpoint.compare(0, 5, "unix:") == 0){
+    std::string path = endpoint.substr(5);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    if (path.empty() || path.size() >= sizeof(address.sun_path)){
+      error = "Invalid unix socket path " + path;
+      return -1;
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size());
+    unlink(path.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0){
+      error = "Cannot bind " + endpoint + ": " + strerror(errno);
+      if (fd >= 0) close(fd);
+      return -1;
+    }
+  } else if (endpoint.compare(0, 4, "tcp:") == 0){
+    std::string host_port = endpoint.substr(4);
+    std::string host, port = host_port;
+    size_t colon = host_port.rfind(':');
+    if (colon != std::string::npos){
+      host = host_port.substr(0, colon);
+      port = host_port.substr(colon + 1);
+    }
+    struct addrinfo hints, *addresses = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int rc = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &addresses);
+    if (rc != 0){
+      error = "Cannot resolve " + endpoint + ": " + gai_strerror(rc);
+      return -1;
+    }
+    fd = socket(addresses->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    if (fd >= 0){
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (fd < 0 || bind(fd, addresses->ai_addr, addresses->ai_addrlen) != 0){
+      error = "Cannot bind " + endpoint + ": " + strerror(errno);
+      if (fd >= 0) close(fd);
+      freeaddrinfo(addresses);
+      return -1;
+    }
+    freeaddrinfo(addresses);
+  } else {
+    error = "Invalid endpoint " + endpoint + " (expected tcp:[HOST:]PORT or unix:PATH)";
+    return -1;
+  }
+  if (listen(fd, SOMAXCONN) != 0){
+    error = "Cannot listen on " + endpoint + ": " + strerror(errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Feeds action lines into the engine and decides which session each result
+// belongs to. Shared by every transport that serves more than one client.
+class session_router_t
+{
+public:
+    explicit session_router_t(SimpleCross& engine) : engine(engine), journal(NULL) {}
+
+    // In sync journal mode results are only sent once the journal holds them.
+    void set_journal(journal_t* action_journal){
+      journal = action_journal;
+    }
+
+    // Processes one action line from `session` and calls send(session, result)
+    // for every result line, addressed as described at the top of this file;
+    // session is EVERY_SESSION for a result that goes to all of them.
+    template <typename Send>
+    void dispatch(uint64_t session, const std::string& line, Send send){
+      int order_id;
+      bool by_id = line.size() > 2 && line[1] == ' ' && parse_order_id(line, order_id);
+      if (by_id && (line[0] == 'X' || line[0] == 'R')){
+        std::unordered_map<int, uint64_t>::const_iterator owner = owners.find(order_id);
+        if (owner != owners.end() && owner->second != session){
+          send(session, "E " + std::to_string(order_id) + " Order entered by another session");
+          return;
+        }
+      }
+      results_t results = engine.action(line);
+      if (journal != NULL && journal->holds_results() && !journal->wait_durable(journal->sequence())){
+        return;
+      }
+      if (by_id && line[0] == 'O' && engine.is_resting(order_id)){
+        owners.emplace(order_id, session);
+      }
+      for (const std::string& result : results){
+        uint64_t destination = session;
+        if ((result[0] == 'L' || result[0] == 'B') && result.size() > 1 && result[1] == ' '){
+          destination = EVERY_SESSION;
+        } else if (result[0] == 'F' && parse_order_id(result, order_id)){
+          std::unordered_map<int, uint64_t>::const_iterator owner = owners.find(order_id);
+          if (owner != owners.end()){
+            destination = owner->second;
+          }
+        }
+        send(destination, result);
+      }
+      // Filled and cancelled orders need no route any more.
+      for (const std::string& result : results){
+        if ((result[0] == 'F' || result[0] == 'X') && parse_order_id(result, order_id) && !engine.is_resting(order_id)){
+          owners.erase(order_id);
+        }
+      }
+    }
+
+    // Frames complete lines out of a session's input buffer and dispatches
+    // them, leaving any partial line in place. Input that grows past
+    // MAX_LINE_LENGTH without a newline is discarded with an error.
+    template <typename Send>
+    void dispatch_input(uint64_t session, std::string& input, Send send){
+      size_t start = 0, newline;
+      while ((newline = input.find('\n', start)) != std::string::npos){
+        size_t end = newline;
+        if (end > start && input[end - 1] == '\r'){
+          end--;
+        }
+        dispatch(session, input.substr(start, end - start), send);
+        start = newline + 1;
+      }
+      input.erase(0, start);
+      if (input.size() > MAX_LINE_LENGTH){
+        input.clear();
+        send(session, "E Line too long");
+      }
+    }
+
+    // Reads the OID out of "<char> <oid> ...".
+    static bool parse_order_id(const std::string& line, int& order_id){
+      if (line.size() < 3){
+        return false;
+      }
+      char* end = NULL;
+      long value = std::strtol(line.c_str() + 2, &end, 10);
+      if (end == line.c_str() + 2){
+        return false;
+      }
+      order_id = (int)value;
+      return true;
+    }
+private:
+    SimpleCross& engine;
+    journal_t* journal;
+    std::unordered_map<int, uint64_t> owners;
+};
+
+// Epoll based order entry server. Level triggered; every socket is non-blocking.
+class epoll_server_t
+{
+public:
+    epoll_server_t(SimpleCross& engine) : router(engine), epoll_fd(-1), listen_fd(-1), next_session(1), publisher(NULL) {}
+
+    ~epoll_server_t(){
+      for (std::unordered_map<int, connection_t>::iterator it = connections.begin(); it != connections.end(); ++it){
+        close(it->first);
+      }
+      if (listen_fd >= 0) close(listen_fd);
+      if (epoll_fd >= 0) close(epoll_fd);
+    }
+
+    // Holds results until durable when the journal runs in sync mode.
+    void set_journal(journal_t* journal){
+      router.set_journal(journal);
+    }
+
+    // Answers the publisher's snapshot requests from the event loop, so they
+    // do not wait for the next action. Call before start().
+    void set_publisher(md_publisher_t* md_publisher){
+      publisher = md_publisher;
+    }
+
+    bool start(const std::string& endpoint, std::string& error){
+      tcp = endpoint.compare(0, 4, "tcp:") == 0;
+      listen_fd = open_listener(endpoint, error);
+      if (listen_fd < 0){
+        return false;
+      }
+      epoll_fd = epoll_create1(0);
+      if (epoll_fd < 0 || !watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD)
+          || (publisher != NULL && !watch(publisher->snapshot_socket(), EPOLLIN, EPOLL_CTL_ADD))){
+        error = std::string("Cannot create epoll instance: ") + strerror(errno);
+        return false;
+      }
+      return true;
+    }
+
+    // Runs until SIGINT/SIGTERM.
+    void run(){
+      std::vector<struct epoll_event> events(256);
+      while (!server_stop_requested){
+        int count = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+        if (count < 0){
+          if (errno == EINTR) continue;
+          std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+          break;
+        }
+        for (int i = 0; i < count; i++){
+          int fd = events[i].data.fd;
+          if (fd == listen_fd){
+            accept_clients();
+            continue;
+          }
+          if (publisher != NULL && fd == publisher->snapshot_socket()){
+            publisher->serve_snapshots();
+            continue;
+          }
+          if (events[i].events & EPOLLOUT){
+            flush(fd);
+          }
+          if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+            read_client(fd);
+          }
+        }
+        flush_pending();
+        disconnect_stalled();
+      }
+    }
+private:
+    struct connection_t {
+      uint64_t session;
+      std::string input;
+      std::string output;
+      bool writing;
+      bool closing;
+      bool stalled;           // over MAX_PENDING_OUTPUT, disconnected after this batch
+    };
+
+    bool watch(int fd, uint32_t events, int operation){
+      struct epoll_event event;
+      memset(&event, 0, sizeof(event));
+      event.events = events;
+      event.data.fd = fd;
+      return epoll_ctl(epoll_fd, operation, fd, &event) == 0;
+    }
+
+    void accept_clients(){
+      while (true){
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0){
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            std::cerr << "accept failed: " << strerror(errno) << std::endl;
+          }
+          return;
+        }
+        if (tcp){
+          int one = 1;
+          setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        connection_t& connection = connections[fd];
+        connection.session = next_session++;
+        connection.writing = false;
+        connection.closing = false;
+        connection.stalled = false;
+        sessions[connection.session] = fd;
+        watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+      }
+    }
+
+    void read_client(int fd){
+      std::unordered_map<int, connection_t>::iterator it = connections.find(fd);
+      if (it == connections.end()){
+        return;
+      }
+      char buffer[16 * 1024];
+      bool peer_closed = false;
+      while (true){
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count > 0){
+          it->second.input.append(buffer, count);
+          continue;
+        }
+        if (count < 0 && errno == EINTR) continue;
+        peer_closed = count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        break;
+      }
+      process_lines(it->second);
+      if (peer_closed){
+        it->second.closing = true;
+        if (it->second.output.empty()){
+          disconnect(fd);
+        }
+      }
+    }
+
+    void process_lines(connection_t& connection){
+      uint64_t requester = connection.session;
+      router.dispatch_input(requester, connection.input, [this, requester](uint64_t session, const std::string& result){
+        this->send(session, result, requester);
+      });
+    }
+
+    // Queues a result line for a session; it is written once the current batch
+    // of events has been processed. A line for a session other than the
+    // requester never waits for that session: if it already holds
+    // MAX_PENDING_OUTPUT unread, it is marked stalled and dropped instead.
+    void send(uint64_t session, const std::string& result, uint64_t requester){
+      if (session == EVERY_SESSION){
+        for (std::unordered_map<uint64_t, int>::const_iterator it = sessions.begin(); it != sessions.end(); ++it){
+          send(it->first, result, requester);
+        }
+        return;
+      }
+      std::unordered_map<uint64_t, int>::const_iterator destination = sessions.find(session);
+      if (destination == sessions.end()){
+        return;
+      }
+      connection_t& connection = connections[destination->second];
+      if (connection.stalled){
+        return;
+      }
+      if (session != requester && connection.output.size() >= MAX_PENDING_OUTPUT){
+        connection.stalled = true;
+        connection.output.clear();
+        stalled.push_back(destination->second);
+        return;
+      }
+      if (connection.output.empty()){
+        pending.push_back(destination->second);
+      }
+      connection.output += result;
+      connection.output += '\n';
+    }
+
+    void flush_pending(){
+      for (int fd : pending){
+        flush(fd);
+      }
+      pending.clear();
+    }
+
+    // Writes as much queued output as the socket takes; arms EPOLLOUT for the rest.
+    void flush(int fd){
+      std::unordered_map<int, connection_t>::iterator it = connections.find(fd);
+      if (it == connections.end()){
+        return;
+      }
+      connection_t& connection = it->second;
+      size_t written = 0;
+      while (written < connection.output.size()){
+        ssize_t count = write(fd, connection.output.data() + written, connection.output.size() - written);
+        if (count > 0){
+          written += count;
+          continue;
+        }
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        disconnect(fd);
+        return;
+      }
+      connection.output.erase(0, written);
+      bool want_write = !connection.output.empty();
+      if (!want_write && connection.closing){
+        disconnect(fd);
+        return;
+      }
+      if (want_write != connection.writing){
+        connection.writing = want_write;
+        watch(fd, want_write ? (EPOLLIN | EPOLLOUT) : EPOLLIN, EPOLL_CTL_MOD);
+      }
+    }
+
+    // Disconnects the sessions send() found stalled; deferred so that a
+    // broadcast never changes the session map it is walking.
+    void disconnect_stalled(){
+      for (int fd : stalled){
+        std::unordered_map<int, connection_t>::iterator it = connections.find(fd);
+        if (it != connections.end() && it->second.stalled){
+          std::cerr << "session " << it->second.session << " stopped reading, disconnected" << std::endl;
+          disconnect(fd);
+        }
+      }
+      stalled.clear();
+    }
+
+    void disconnect(int fd){
+      std::unordered_map<int, connection_t>::iterator it = connections.find(fd);
+      if (it == connections.end()){
+        return;
+      }
+      sessions.erase(it->second.session);
+      connections.erase(it);
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+      close(fd);
+    }
+
+    session_router_t router;
+    int epoll_fd;
+    int listen_fd;
+    bool tcp;
+    uint64_t next_session;
+    std::unordered_map<int, connection_t> connections;
+    std::unordered_map<uint64_t, int> sessions;
+    std::vector<int> pending;
+    std::vector<int> stalled;
+    md_publisher_t* publisher;
+};
+
+#endif
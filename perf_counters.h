@@ -0,0 +1,163 @@
+/*
+Hardware performance counters around a benchmark phase, via perf_event_open.
+
+perf_counters_t opens cycles, instructions, L1D read misses, last level
+cache read misses, branch misses and dTLB read misses for the calling
+process (user space only; each counter follows the thread that opened it).
+Counters the CPU or kernel does not offer are skipped and reported as
+unavailable. The counters are opened one by one rather than as a group, so
+the kernel may multiplex them when there are more events than hardware
+counters; every reading is scaled by time enabled / time running, and a
+phase where that happened is marked as scaled.
+
+Opening fails as a whole when perf_event_open is refused (e.g.
+kernel.perf_event_paranoid above 2, or a container without the syscall).
+*/
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum perf_counter_t {
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_DTLB_MISSES,
+  PERF_COUNTERS
+};
+
+const char* const PERF_COUNTER_NAMES[PERF_COUNTERS] = {
+  "cycles", "instructions", "L1D misses", "LLC misses", "branch misses", "dTLB misses"
+};
+
+// Scaled counts of one phase; -1 for a counter that is not available.
+struct perf_reading_t {
+  double counts[PERF_COUNTERS];
+  bool scaled;
+};
+
+class perf_counters_t
+{
+public:
+    perf_counters_t(){
+      for (int i = 0; i < PERF_COUNTERS; i++){
+        fds[i] = -1;
+      }
+    }
+
+    ~perf_counters_t(){
+      for (int i = 0; i < PERF_COUNTERS; i++){
+        if (fds[i] >= 0){
+          close(fds[i]);
+        }
+      }
+    }
+
+    // Opens what the machine offers; false with error if nothing could be.
+    bool open(std::string& error){
+      const uint32_t types[PERF_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+      };
+      const uint64_t configs[PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        cache_miss(PERF_COUNT_HW_CACHE_L1D),
+        cache_miss(PERF_COUNT_HW_CACHE_LL),
+        PERF_COUNT_HW_BRANCH_MISSES,
+        cache_miss(PERF_COUNT_HW_CACHE_DTLB)
+      };
+      int opened = 0;
+      for (int i = 0; i < PERF_COUNTERS; i++){
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[i] >= 0){
+          opened++;
+        } else if (error.empty()){
+          error = std::string("perf_event_open: ") + strerror(errno);
+        }
+      }
+      if (opened == 0){
+        return false;
+      }
+      error.clear();
+      return true;
+    }
+
+    void start(){
+      for (int i = 0; i < PERF_COUNTERS; i++){
+        if (fds[i] >= 0){
+          ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+          ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+      }
+    }
+
+    perf_reading_t stop(){
+      perf_reading_t reading;
+      reading.scaled = false;
+      for (int i = 0; i < PERF_COUNTERS; i++){
+        reading.counts[i] = -1;
+        if (fds[i] < 0){
+          continue;
+        }
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t values[3];  // value, time enabled, time running
+        if (read(fds[i], values, sizeof(values)) != sizeof(values) || values[2] == 0){
+          continue;
+        }
+        reading.counts[i] = (double)values[0] * values[1] / values[2];
+        reading.scaled = reading.scaled || values[2] < values[1];
+      }
+      return reading;
+    }
+private:
+    static uint64_t cache_miss(uint64_t cache){
+      return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+
+    int fds[PERF_COUNTERS];
+};
+
+// "<phase> (per action): cycles 812.30, instructions 1650.10, ..., IPC 2.03",
+// the counts divided by `per` units.
+inline std::string perf_summary(const std::string& phase, const perf_reading_t& reading, double per, const char* unit){
+  char text[160];
+  std::string summary = phase + " (per " + unit + "):";
+  for (int i = 0; i < PERF_COUNTERS; i++){
+    if (reading.counts[i] < 0){
+      snprintf(text, sizeof(text), "%s %s n/a", i ? "," : "", PERF_COUNTER_NAMES[i]);
+    } else {
+      snprintf(text, sizeof(text), "%s %s %.2f", i ? "," : "", PERF_COUNTER_NAMES[i], reading.counts[i] / per);
+    }
+    summary += text;
+  }
+  if (reading.counts[PERF_CYCLES] > 0 && reading.counts[PERF_INSTRUCTIONS] >= 0){
+    snprintf(text, sizeof(text), ", IPC %.2f", reading.counts[PERF_INSTRUCTIONS] / reading.counts[PERF_CYCLES]);
+    summary += text;
+  }
+  if (reading.scaled){
+    summary += " (multiplexed, scaled)";
+  }
+  return summary;
+}
+
+#endif
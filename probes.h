@@ -0,0 +1,166 @@
+/*
+Cycle-counting probes for the stages of the engine's hot path.
+
+PROBE_SPAN(stage) opens a span that lasts until the end of the enclosing
+block and charges the TSC cycles spent in it to `stage`. Spans nest; time
+spent in an inner span is charged to the inner stage only, so the stages of
+an action add up to the time spent inside spans and nothing is counted
+twice.
+
+Totals are kept per thread in a fixed array (no allocation after the first
+span of a thread) and threads register their arrays in a fixed global table
+so probe_report() can sum them. Compiled in with -DSIMPLE_CROSS_PROBES
+("make PROBES=1"); otherwise PROBE_SPAN expands to nothing.
+*/
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum probe_stage_t {
+  PROBE_PARSE = 0,      // tokenizing and number parsing
+  PROBE_VALIDATE,       // field checks, duplicate and order id lookups
+  PROBE_SYMBOL,         // symbol to book lookup
+  PROBE_LEVEL_WALK,     // walking opposite levels and orders while crossing
+  PROBE_FILL,           // applying a fill to the resting order
+  PROBE_INSERT,         // resting an order: level lookup and linking
+  PROBE_REMOVE,         // taking a cancelled order out of its level
+  PROBE_OUTPUT,         // formatting result lines and handing them to the sink
+  PROBE_STAGES
+};
+
+const char* const PROBE_NAMES[PROBE_STAGES] = {
+  "parse", "validation", "symbol lookup", "level walk", "fill", "book insert", "book remove", "output formatting"
+};
+
+const int PROBE_MAX_THREADS = 64;
+
+struct probe_totals_t {
+  uint64_t cycles[PROBE_STAGES];
+  uint64_t spans[PROBE_STAGES];
+};
+
+inline uint64_t probe_clock(){
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Totals of every thread that opened a span.
+struct probe_registry_t {
+  std::atomic<int> threads;
+  probe_totals_t* totals[PROBE_MAX_THREADS];
+};
+
+inline probe_registry_t& probe_registry(){
+  static probe_registry_t registry;
+  return registry;
+}
+
+inline probe_totals_t& probe_thread_totals(){
+  static thread_local probe_totals_t totals;
+  static thread_local bool registered = false;
+  if (!registered){
+    registered = true;
+    int slot = probe_registry().threads.fetch_add(1);
+    if (slot < PROBE_MAX_THREADS){
+      probe_registry().totals[slot] = &totals;
+    }
+  }
+  return totals;
+}
+
+class probe_span_t
+{
+public:
+    probe_span_t(probe_stage_t stage) : stage(stage), children(0), parent(current()) {
+      current() = this;
+      start = probe_clock();
+    }
+
+    ~probe_span_t(){
+      uint64_t elapsed = probe_clock() - start;
+      probe_totals_t& totals = probe_thread_totals();
+      totals.cycles[stage] += elapsed - children;
+      totals.spans[stage]++;
+      if (parent != NULL){
+        parent->children += elapsed;
+      }
+      current() = parent;
+    }
+private:
+    static probe_span_t*& current(){
+      static thread_local probe_span_t* span = NULL;
+      return span;
+    }
+
+    probe_stage_t stage;
+    uint64_t start;
+    uint64_t children;
+    probe_span_t* parent;
+};
+
+// Ticks of probe_clock() per ns, measured over a short sleep.
+inline double probe_ticks_per_ns(){
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  uint64_t first = probe_clock();
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  uint64_t last = probe_clock();
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+  return (last - first) / ns;
+}
+
+// Cycle breakdown by stage summed over all threads, one line per stage that
+// ran: total cycles, share, spans and cycles (and ns) per span.
+inline std::string probe_report(){
+  probe_totals_t sum = {};
+  probe_registry_t& registry = probe_registry();
+  int threads = std::min(registry.threads.load(), PROBE_MAX_THREADS);
+  for (int t = 0; t < threads; t++){
+    for (int stage = 0; stage < PROBE_STAGES; stage++){
+      sum.cycles[stage] += registry.totals[t]->cycles[stage];
+      sum.spans[stage] += registry.totals[t]->spans[stage];
+    }
+  }
+  uint64_t total = 0;
+  for (int stage = 0; stage < PROBE_STAGES; stage++){
+    total += sum.cycles[stage];
+  }
+  double ticks_per_ns = probe_ticks_per_ns();
+  char line[160];
+  snprintf(line, sizeof(line), "probe breakdown: %llu cycles over %d threads, %.2f cycles/ns\n",
+           (unsigned long long)total, threads, ticks_per_ns);
+  std::string report = line;
+  for (int stage = 0; stage < PROBE_STAGES; stage++){
+    if (sum.spans[stage] == 0){
+      continue;
+    }
+    double per_span = (double)sum.cycles[stage] / sum.spans[stage];
+    snprintf(line, sizeof(line), "  %-18s %14llu cycles %5.1f%% %11llu spans %8.1f cycles/span %8.1f ns/span\n",
+             PROBE_NAMES[stage], (unsigned long long)sum.cycles[stage], total ? 100.0 * sum.cycles[stage] / total : 0.0,
+             (unsigned long long)sum.spans[stage], per_span, per_span / ticks_per_ns);
+    report += line;
+  }
+  return report;
+}
+
+#define PROBE_CONCAT_(a, b) a##b
+#define PROBE_CONCAT(a, b) PROBE_CONCAT_(a, b)
+#ifdef SIMPLE_CROSS_PROBES
+#define PROBE_SPAN(stage) probe_span_t PROBE_CONCAT(probe_span_, __LINE__)(stage)
+#else
+#define PROBE_SPAN(stage)
+#endif
+
+#endif
@@ -0,0 +1,126 @@
+/*
+High-speed replay of a journal through a fresh engine, checking that every
+action produces exactly the results that were recorded.
+
+The journal is decoded up front into one buffer of action lines; the timed
+loop then runs SimpleCross::execute() over that buffer with a sink that only
+hashes the result bytes, so the measured rate is the engine's own and no
+result is ever materialised as a std::string.
+
+Results are hashed with 64-bit FNV-1a, each line followed by '\n' (the bytes
+the file driver would print). Every action's hash is compared with the hash
+of its recorded results, and a rolling hash over the whole session is
+reported so two replays can be compared by eye. S (statistics) actions are
+run but left out of both: their counters depend on the process's history
+and their latencies on the machine.
+*/
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+#include "simple_cross.h"
+#include "journal.h"
+
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+inline uint64_t fnv1a(uint64_t hash, const char* data, size_t length){
+  for (size_t i = 0; i < length; i++){
+    hash = (hash ^ (unsigned char)data[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+// execute() sink: hashes the results of the current action and of the whole
+// session.
+struct result_hash_t {
+  result_hash_t() : action(FNV_OFFSET), session(FNV_OFFSET), results(0) {}
+
+  void operator()(const char* text, size_t length){
+    action = (fnv1a(action, text, length) ^ '\n') * FNV_PRIME;
+    session = (fnv1a(session, text, length) ^ '\n') * FNV_PRIME;
+    results++;
+  }
+
+  uint64_t action;
+  uint64_t session;
+  uint64_t results;
+};
+
+// execute() sink that drops the results.
+struct result_discard_t {
+  void operator()(const char* text, size_t length){}
+};
+
+struct replay_report_t {
+  uint64_t actions = 0;
+  uint64_t results = 0;
+  uint64_t mismatched = 0;
+  uint64_t first_mismatch = 0;      // sequence of the first differing action
+  uint64_t session_hash = 0;
+  uint64_t recorded_hash = 0;
+  bool torn_tail = false;
+  double seconds = 0;
+};
+
+// Replays the journal at path into `engine`, which must be empty. The
+// journal must start at action 1.
+inline bool replay_journal(SimpleCross& engine, const std::string& path, replay_report_t& report, std::string& error){
+  journal_reader_t reader;
+  if (!reader.open(path, error)){
+    return false;
+  }
+  if (reader.first_sequence() != 1){
+    error = "Journal " + path + " starts at action " + std::to_string(reader.first_sequence())
+            + ", replay needs the whole session";
+    return false;
+  }
+  engine.set_book_deltas(reader.book_deltas());
+  std::string lines;
+  std::vector<size_t> ends;
+  std::vector<uint64_t> expected;
+  result_hash_t recorded;
+  journal_entry_t entry;
+  while (reader.next(entry)){
+    lines.append(entry.action);
+    ends.push_back(lines.size());
+    recorded.action = FNV_OFFSET;
+    if (!is_stats_action(entry.action.data(), entry.action.size())){
+      for (const std::string& result : entry.results){
+        recorded(result.data(), result.size());
+      }
+    }
+    expected.push_back(recorded.action);
+  }
+  report.torn_tail = reader.torn_tail();
+  report.recorded_hash = recorded.session;
+
+  engine.reserve(ends.size());
+  result_hash_t produced;
+  result_discard_t discarded;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  size_t begin = 0;
+  for (size_t i = 0; i < ends.size(); i++){
+    produced.action = FNV_OFFSET;
+    if (is_stats_action(lines.data() + begin, ends[i] - begin)){
+      engine.execute(lines.data() + begin, ends[i] - begin, discarded);
+    } else {
+      engine.execute(lines.data() + begin, ends[i] - begin, produced);
+    }
+    if (produced.action != expected[i] && report.mismatched++ == 0){
+      report.first_mismatch = i + 1;
+    }
+    begin = ends[i];
+  }
+  report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  report.actions = ends.size();
+  report.results = produced.results;
+  report.session_hash = produced.session;
+  return true;
+}
+
+#endif
@@ -0,0 +1,188 @@
+/*
+Command line options for the simple_cross driver.
+
+    ./simple_cross [--input FILE] [--latency]
+                   [--busy-poll [--ingest-cpu N] [--match-cpu N] [--prefault N]]
+    ./simple_cross --listen ENDPOINT [--io-uring]
+    ./simple_cross --shm NAME [--match-cpu N]
+    ./simple_cross --replay FILE
+
+    Any mode also takes [--md-multicast GROUP:PORT [--md-interface ADDR]]
+    and [--journal FILE [--journal-mode M] [--journal-interval US] [--journal-batch N]]
+    and [--checkpoint FILE [--checkpoint-every N]] or [--book-file PREFIX]
+    and [--trace FILE [--trace-sample N]] and [--deltas level|order].
+
+    --input FILE     read actions from FILE instead of actions.txt ("-" for stdin)
+    --latency        report per-action latency percentiles on stderr at exit
+    --busy-poll      low latency mode: ingest and matcher threads spin instead of
+                     blocking, memory is locked with mlockall and pre-faulted
+    --ingest-cpu N   pin the ingest thread to core N (busy-poll mode)
+    --match-cpu N    pin the matcher thread to core N (busy-poll mode)
+    --prefault N     number of orders to pre-size the engine for (busy-poll mode)
+    --listen EP      serve clients on EP ("tcp:[HOST:]PORT" or "unix:PATH")
+                     instead of reading a file
+    --io-uring       use the io_uring server backend (falls back to epoll when
+                     the kernel does not support it)
+    --shm NAME       serve co-located clients through the shared memory region
+                     NAME (see shm_transport.h)
+    --md-multicast G publish incremental price level market data to the UDP
+                     multicast group G ("A.B.C.D:PORT", see market_data.h)
+    --md-interface A local interface address for the feed and the snapshot
+                     channel (default 127.0.0.1)
+    --journal FILE   record every action and its results in the binary journal
+                     FILE (see journal.h); an existing journal is replayed at
+                     startup and continued
+    --journal-mode M durability: async, group (default) or sync
+    --journal-interval US
+                     longest time a record waits for its group commit (default 200)
+    --journal-batch N
+                     records that trigger a group commit early (default 256)
+    --checkpoint FILE
+                     restore the engine from checkpoint FILE (if present) before
+                     replaying the journal, write a checkpoint in the background
+                     every --checkpoint-every actions and one at exit (see
+                     checkpoint.h)
+    --checkpoint-every N
+                     actions between background checkpoints (default 1000000,
+                     0 for only at exit)
+    --book-file PREFIX
+                     keep the order pool, order ids and symbols in the memory
+                     mapped files PREFIX.orders, PREFIX.ids and PREFIX.symbols
+                     so the book survives a restart without replay (see
+                     mapped_array.h); not combined with --checkpoint
+    --replay FILE    run the whole journal FILE through a fresh engine as fast
+                     as possible, check every action's results against the
+                     recorded ones and report the rate (see replay.h); exits 1
+                     on any difference
+    --trace FILE     write sampled action traces to FILE in Chrome trace event
+                     JSON (see trace.h); needs a "make TRACE=1" build
+    --trace-sample N trace every Nth action (default 100)
+    --deltas M       follow the results of every action that changes the book
+                     with the changes: "level" for L lines per price level,
+                     "order" for B lines per order (see simple_cross.h);
+                     servers send them to every session
+*/
+#ifndef RUN_OPTIONS_H
+#define RUN_OPTIONS_H
+
+#include <string>
+#include <cstdlib>
+#include <iostream>
+
+#include "journal.h"
+
+struct run_options_t {
+  std::string input = "actions.txt";
+  bool report_latency = false;
+  bool busy_poll = false;
+  int ingest_cpu = -1;
+  int match_cpu = -1;
+  size_t prefault_orders = 1 << 18;
+  std::string listen;
+  bool io_uring = false;
+  std::string shm_name;
+  std::string md_multicast;
+  std::string md_interface = "127.0.0.1";
+  std::string journal;
+  journal_mode_t journal_mode = JOURNAL_GROUP;
+  uint64_t journal_interval_us = 200;
+  size_t journal_batch = 256;
+  std::string checkpoint;
+  uint64_t checkpoint_every = 1000000;
+  std::string book_file;
+  std::string replay;
+  book_deltas_t deltas = DELTAS_NONE;
+  std::string trace;
+  uint64_t trace_sample = 100;
+};
+
+inline void print_usage(const char* prog){
+  std::cerr << "usage: " << prog << " [--input FILE] [--latency]" << std::endl
+            << "       [--busy-poll [--ingest-cpu N] [--match-cpu N] [--prefault N]]" << std::endl
+            << "       " << prog << " --listen tcp:[HOST:]PORT|unix:PATH [--io-uring]" << std::endl
+            << "       " << prog << " --shm NAME [--match-cpu N]" << std::endl
+            << "       " << prog << " --replay FILE" << std::endl
+            << "       any mode: [--md-multicast GROUP:PORT [--md-interface ADDR]]" << std::endl
+            << "                 [--journal FILE [--journal-mode async|group|sync] [--journal-interval US] [--journal-batch N]]" << std::endl
+            << "                 [--checkpoint FILE [--checkpoint-every N] | --book-file PREFIX]" << std::endl
+            << "                 [--deltas level|order] [--trace FILE [--trace-sample N]]" << std::endl;
+}
+
+// Reads the numeric value following argv[i]; returns false if it is missing or not a number.
+inline bool option_number(int argc, char** argv, int& i, long& value){
+  if (i+1 >= argc) {
+    return false;
+  }
+  char* end = NULL;
+  value = std::strtol(argv[++i], &end, 10);
+  return *argv[i] != '\0' && *end == '\0' && value >= 0;
+}
+
+inline bool parse_run_options(int argc, char** argv, run_options_t& opts, std::string& error){
+  for (int i = 1; i < argc; i++){
+    std::string arg = argv[i];
+    long value = 0;
+    if (arg == "--input" && i+1 < argc){
+      opts.input = argv[++i];
+    } else if (arg == "--latency"){
+      opts.report_latency = true;
+    } else if (arg == "--listen" && i+1 < argc){
+      opts.listen = argv[++i];
+    } else if (arg == "--shm" && i+1 < argc){
+      opts.shm_name = argv[++i];
+    } else if (arg == "--md-multicast" && i+1 < argc){
+      opts.md_multicast = argv[++i];
+    } else if (arg == "--md-interface" && i+1 < argc){
+      opts.md_interface = argv[++i];
+    } else if (arg == "--journal" && i+1 < argc){
+      opts.journal = argv[++i];
+    } else if (arg == "--journal-mode" && i+1 < argc && parse_journal_mode(argv[i+1], opts.journal_mode)){
+      i++;
+    } else if (arg == "--journal-interval" && option_number(argc, argv, i, value)){
+      opts.journal_interval_us = (uint64_t)value;
+    } else if (arg == "--journal-batch" && option_number(argc, argv, i, value)){
+      opts.journal_batch = (size_t)value;
+    } else if (arg == "--checkpoint" && i+1 < argc){
+      opts.checkpoint = argv[++i];
+    } else if (arg == "--checkpoint-every" && option_number(argc, argv, i, value)){
+      opts.checkpoint_every = (uint64_t)value;
+    } else if (arg == "--book-file" && i+1 < argc){
+      opts.book_file = argv[++i];
+    } else if (arg == "--replay" && i+1 < argc){
+      opts.replay = argv[++i];
+    } else if (arg == "--deltas" && i+1 < argc && (std::string(argv[i+1]) == "level" || std::string(argv[i+1]) == "order")){
+      opts.deltas = std::string(argv[++i]) == "level" ? DELTAS_LEVEL : DELTAS_ORDER;
+    } else if (arg == "--trace" && i+1 < argc){
+      opts.trace = argv[++i];
+    } else if (arg == "--trace-sample" && option_number(argc, argv, i, value) && value >= 1){
+      opts.trace_sample = (uint64_t)value;
+    } else if (arg == "--io-uring"){
+      opts.io_uring = true;
+    } else if (arg == "--busy-poll"){
+      opts.busy_poll = true;
+    } else if (arg == "--ingest-cpu" && option_number(argc, argv, i, value)){
+      opts.ingest_cpu = (int)value;
+    } else if (arg == "--match-cpu" && option_number(argc, argv, i, value)){
+      opts.match_cpu = (int)value;
+    } else if (arg == "--prefault" && option_number(argc, argv, i, value)){
+      opts.prefault_orders = (size_t)value;
+    } else {
+      error = "Invalid option " + arg;
+      return false;
+    }
+  }
+#ifndef SIMPLE_CROSS_TRACE
+  if (!opts.trace.empty()){
+    error = "--trace needs a build with tracing (make TRACE=1)";
+    return false;
+  }
+#endif
+  if (!opts.book_file.empty() && !opts.checkpoint.empty()){
+    // A forked checkpoint writer would see the shared mapping change under it.
+    error = "--book-file and --checkpoint cannot be combined";
+    return false;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,92 @@
+// Benchmark client for the shared-memory transport (see shm_transport.h).
+//
+//     ./shm_bench NAME [ROUND_TRIPS]
+//
+// Attaches to a running "./simple_cross --shm NAME", then alternately places
+// and cancels a one lot order, timing each request from submission until its
+// final response record arrives. Percentiles are printed after a warmup.
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+
+#include "shm_transport.h"
+#include "low_latency.h"
+
+const size_t WARMUP_ROUND_TRIPS = 1000;
+
+// Submits one request and waits for its final record; returns the round trip in ns.
+uint64_t round_trip(shm_region_t* region, shm_request_t& request, size_t& results){
+  unsigned spins = 0;
+  uint64_t start = now_ns();
+  while (!shm_try_push_request(region, request)){
+    shm_wait(spins);
+  }
+  shm_response_t response;
+  spins = 0;
+  while (true){
+    if (!shm_try_pop_response(region, request.client, response)){
+      shm_wait(spins);
+      continue;
+    }
+    if (response.sequence != request.sequence){
+      continue;
+    }
+    if (response.last){
+      break;
+    }
+    results += !response.more;
+  }
+  return now_ns() - start;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2){
+        std::cerr << "usage: " << argv[0] << " NAME [ROUND_TRIPS]" << std::endl;
+        return 1;
+    }
+    size_t count = argc > 2 ? std::strtoul(argv[2], NULL, 10) : 100000;
+    std::string error;
+    shm_region_t* region = shm_attach(argv[1], error);
+    if (region == NULL){
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    int client = shm_claim_client(region);
+    if (client < 0){
+        std::cerr << "no free client slot" << std::endl;
+        shm_detach(region);
+        return 1;
+    }
+    std::vector<uint64_t> samples;
+    samples.reserve(count * 2);
+    shm_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.client = client;
+    memcpy(request.symbol, "SHMBENCH", 8);
+    request.side = 'B';
+    request.qty = 1;
+    request.px = 1.0;
+    uint32_t first_oid = (getpid() % 20000) * 100000 + 1;
+    size_t results = 0;
+    for (size_t i = 0; i < count + WARMUP_ROUND_TRIPS; i++){
+        request.oid = first_oid + i;
+        request.action = 'O';
+        request.sequence++;
+        uint64_t place = round_trip(region, request, results);
+        request.action = 'X';
+        request.sequence++;
+        uint64_t cancel = round_trip(region, request, results);
+        if (i >= WARMUP_ROUND_TRIPS){
+            samples.push_back(place);
+            samples.push_back(cancel);
+        }
+    }
+    std::cout << "round trips: " << samples.size() << ", result records: " << results << std::endl;
+    report_latency("shm round trip", samples);
+    shm_release_client(region, client);
+    shm_detach(region);
+    return 0;
+}
@@ -0,0 +1,352 @@
+/*
+Shared-memory transport for gateways co-located with the matching process.
+
+The server creates a named POSIX shared memory region (shm_open) holding:
+    * one lock-free multi-producer/single-consumer request ring shared by all
+      clients (bounded Vyukov queue: every cell carries a sequence number, a
+      producer claims a position with a compare-and-swap on the enqueue
+      counter)
+    * one single-producer/single-consumer response ring per client slot
+
+Clients attach by name, claim a free slot and submit binary actions
+(shm_request_t). Every request is answered on the client's response ring by
+zero or more result records followed by one record with `last` set. A result
+longer than one record's text continues in the following records, each but
+the final one marked `more`. Fills for
+a resting order entered by another client arrive on that client's ring as
+unsolicited records (sequence 0), and so do book deltas (--deltas) caused by
+another client's request, which every client receives. Results use the same text format as the
+file driver.
+
+The server waits for room on the requester's ring only. An unsolicited
+result that does not fit on its client's ring is dropped and counted in the
+ring's `dropped` field, so a client that stopped reading (or crashed while
+holding its slot) cannot stall the matcher; a client that sees `dropped`
+change has missed fills or deltas and should resynchronize, e.g. with P.
+
+Both sides poll. Waiting spins with a pause instruction and only yields the
+CPU after SPIN_LIMIT empty polls, so on dedicated cores a round trip never
+involves the scheduler while an oversubscribed box still makes progress.
+*/
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include <atomic>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <new>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const uint64_t SHM_MAGIC = 0x53584d48535843ULL;
+const uint32_t SHM_VERSION = 3;
+const uint32_t SHM_MAX_CLIENTS = 16;
+const uint32_t SHM_REQUEST_CAPACITY = 4096;
+const uint32_t SHM_RESPONSE_CAPACITY = 4096;
+const unsigned SPIN_LIMIT = 4096;
+
+// Binary action. `action` is 'O', 'X', 'R', 'P', 'Q', 'D' or 'S'; the
+// remaining fields follow the text protocol (symbol is NUL padded, not
+// terminated when 8 characters long). An amend uses oid, qty and px. `tif`
+// is an order's time in force: 0 or 'D' for DAY, 'I' for IOC, 'F' for FOK.
+// The queries take their argument in symbol: "P SYMBOL" (an empty symbol
+// prints the whole book), "Q SYMBOL", "D SYMBOL N" with N in qty, and
+// "S shape" with "shape" in symbol (empty for plain S).
+struct shm_request_t {
+  uint32_t client;
+  uint32_t sequence;
+  uint32_t oid;
+  uint32_t qty;
+  double px;
+  char symbol[8];
+  char action;
+  char side;
+  char tif;
+  char padding[5];
+};
+
+// One result line, or a piece of one, for a client; `sequence` echoes the
+// request it answers, 0 for unsolicited fills. `more` means the line goes on
+// in the next record.
+struct shm_response_t {
+  uint32_t sequence;
+  uint16_t length;
+  uint8_t last;
+  uint8_t more;
+  char text[56];
+};
+
+struct shm_request_cell_t {
+  std::atomic<uint64_t> sequence;
+  shm_request_t request;
+};
+
+struct alignas(64) shm_response_ring_t {
+  alignas(64) std::atomic<uint32_t> in_use;
+  std::atomic<uint32_t> dropped;        // unsolicited results lost to a full ring
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  shm_response_t slots[SHM_RESPONSE_CAPACITY];
+};
+
+struct shm_region_t {
+  uint64_t magic;
+  uint32_t version;
+  std::atomic<uint32_t> server_ready;
+  alignas(64) std::atomic<uint64_t> enqueue_position;
+  alignas(64) std::atomic<uint64_t> dequeue_position;
+  alignas(64) shm_request_cell_t requests[SHM_REQUEST_CAPACITY];
+  shm_response_ring_t responses[SHM_MAX_CLIENTS];
+};
+
+// Spin-then-yield wait step; `spins` counts consecutive empty polls.
+inline void shm_wait(unsigned& spins){
+  if (++spins < SPIN_LIMIT){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+inline std::string shm_path(const std::string& name){
+  return name[0] == '/' ? name : "/" + name;
+}
+
+// Creates (or re-creates) and maps the region. Returns NULL on failure.
+inline shm_region_t* shm_create(const std::string& name, std::string& error){
+  std::string path = shm_path(name);
+  shm_unlink(path.c_str());
+  int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0 || ftruncate(fd, sizeof(shm_region_t)) != 0){
+    error = "Cannot create shared memory " + path + ": " + strerror(errno);
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  void* memory = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED){
+    error = "Cannot map shared memory " + path + ": " + strerror(errno);
+    return NULL;
+  }
+  shm_region_t* region = new (memory) shm_region_t();
+  region->magic = SHM_MAGIC;
+  region->version = SHM_VERSION;
+  region->enqueue_position.store(0);
+  region->dequeue_position.store(0);
+  for (uint32_t i = 0; i < SHM_REQUEST_CAPACITY; i++){
+    region->requests[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  for (uint32_t i = 0; i < SHM_MAX_CLIENTS; i++){
+    region->responses[i].in_use.store(0, std::memory_order_relaxed);
+    region->responses[i].head.store(0, std::memory_order_relaxed);
+    region->responses[i].tail.store(0, std::memory_order_relaxed);
+  }
+  region->server_ready.store(1, std::memory_order_release);
+  return region;
+}
+
+// Maps an existing region created by the server. Returns NULL on failure.
+inline shm_region_t* shm_attach(const std::string& name, std::string& error){
+  std::string path = shm_path(name);
+  int fd = shm_open(path.c_str(), O_RDWR, 0);
+  if (fd < 0){
+    error = "Cannot open shared memory " + path + ": " + strerror(errno);
+    return NULL;
+  }
+  void* memory = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED){
+    error = "Cannot map shared memory " + path + ": " + strerror(errno);
+    return NULL;
+  }
+  shm_region_t* region = static_cast<shm_region_t*>(memory);
+  if (region->magic != SHM_MAGIC || region->version != SHM_VERSION || !region->server_ready.load(std::memory_order_acquire)){
+    error = "Shared memory " + path + " is not a ready SimpleCross region";
+    munmap(memory, sizeof(shm_region_t));
+    return NULL;
+  }
+  return region;
+}
+
+inline void shm_detach(shm_region_t* region){
+  munmap(region, sizeof(shm_region_t));
+}
+
+// Producer side of the request ring; safe to call from any number of clients.
+// Returns false if the ring is full.
+inline bool shm_try_push_request(shm_region_t* region, const shm_request_t& request){
+  uint64_t position = region->enqueue_position.load(std::memory_order_relaxed);
+  while (true){
+    shm_request_cell_t& cell = region->requests[position % SHM_REQUEST_CAPACITY];
+    uint64_t sequence = cell.sequence.load(std::memory_order_acquire);
+    int64_t difference = (int64_t)sequence - (int64_t)position;
+    if (difference == 0){
+      if (region->enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)){
+        cell.request = request;
+        cell.sequence.store(position + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (difference < 0){
+      return false;
+    } else {
+      position = region->enqueue_position.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+// Consumer side of the request ring; only the server calls this.
+inline bool shm_try_pop_request(shm_region_t* region, shm_request_t& request){
+  uint64_t position = region->dequeue_position.load(std::memory_order_relaxed);
+  shm_request_cell_t& cell = region->requests[position % SHM_REQUEST_CAPACITY];
+  if (cell.sequence.load(std::memory_order_acquire) != position + 1){
+    return false;
+  }
+  request = cell.request;
+  cell.sequence.store(position + SHM_REQUEST_CAPACITY, std::memory_order_release);
+  region->dequeue_position.store(position + 1, std::memory_order_relaxed);
+  return true;
+}
+
+// Fills one record with the part of `text` from `offset`; returns the
+// offset of the rest.
+inline size_t shm_fill_response(shm_response_t& slot, uint32_t sequence, const std::string& text, size_t offset, bool last){
+  size_t length = std::min(text.size() - offset, sizeof(slot.text));
+  slot.sequence = sequence;
+  slot.length = length;
+  slot.more = offset + length < text.size();
+  slot.last = last && !slot.more;
+  memcpy(slot.text, text.data() + offset, length);
+  return offset + length;
+}
+
+// Server side: appends a result to a client's response ring, split over as
+// many records as it needs, waiting while the ring is full. Records for a
+// slot nobody holds are dropped. Only for the client that made the request
+// being answered, which is reading its ring.
+inline void shm_push_response(shm_region_t* region, uint32_t client, uint32_t sequence, const std::string& text, bool last){
+  shm_response_ring_t& ring = region->responses[client];
+  size_t offset = 0;
+  do {
+    if (!ring.in_use.load(std::memory_order_relaxed)){
+      return;
+    }
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    unsigned spins = 0;
+    while (tail - ring.head.load(std::memory_order_acquire) == SHM_RESPONSE_CAPACITY){
+      if (!ring.in_use.load(std::memory_order_relaxed)){
+        return;
+      }
+      shm_wait(spins);
+    }
+    offset = shm_fill_response(ring.slots[tail % SHM_RESPONSE_CAPACITY], sequence, text, offset, last);
+    ring.tail.store(tail + 1, std::memory_order_release);
+  } while (offset < text.size());
+}
+
+// Server side: appends an unsolicited result (sequence 0) without waiting.
+// When the ring lacks room for all of its records the result is dropped and
+// the ring's `dropped` count goes up, so a client that stopped reading never
+// stalls the matcher. False if the result was not delivered.
+inline bool shm_try_push_response(shm_region_t* region, uint32_t client, const std::string& text){
+  shm_response_ring_t& ring = region->responses[client];
+  if (!ring.in_use.load(std::memory_order_relaxed)){
+    return false;
+  }
+  uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+  size_t records = std::max<size_t>(1, (text.size() + sizeof(ring.slots[0].text) - 1) / sizeof(ring.slots[0].text));
+  if (SHM_RESPONSE_CAPACITY - (tail - ring.head.load(std::memory_order_acquire)) < records){
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  size_t offset = 0;
+  do {
+    offset = shm_fill_response(ring.slots[tail++ % SHM_RESPONSE_CAPACITY], 0, text, offset, false);
+  } while (offset < text.size());
+  ring.tail.store(tail, std::memory_order_release);
+  return true;
+}
+
+// Client side: takes the next record from the client's response ring.
+inline bool shm_try_pop_response(shm_region_t* region, uint32_t client, shm_response_t& response){
+  shm_response_ring_t& ring = region->responses[client];
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  if (head == ring.tail.load(std::memory_order_acquire)){
+    return false;
+  }
+  response = ring.slots[head % SHM_RESPONSE_CAPACITY];
+  ring.head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+// Claims a free client slot; returns -1 if all are taken. Stale records left
+// by a previous holder are skipped.
+inline int shm_claim_client(shm_region_t* region){
+  for (uint32_t client = 0; client < SHM_MAX_CLIENTS; client++){
+    uint32_t expected = 0;
+    shm_response_ring_t& ring = region->responses[client];
+    if (ring.in_use.compare_exchange_strong(expected, 1)){
+      ring.head.store(ring.tail.load(std::memory_order_acquire), std::memory_order_release);
+      ring.dropped.store(0, std::memory_order_relaxed);
+      return client;
+    }
+  }
+  return -1;
+}
+
+inline void shm_release_client(shm_region_t* region, int client){
+  region->responses[client].in_use.store(0, std::memory_order_release);
+}
+
+// The optional time in force field of an order line; an unknown code is
+// passed on so the engine rejects the order rather than resting it as DAY.
+inline const char* shm_tif_field(char tif){
+  switch (tif){
+    case 0:
+    case 'D':
+      return "";
+    case 'I':
+      return " IOC";
+    case 'F':
+      return " FOK";
+    default:
+      return " ?";
+  }
+}
+
+// Renders a binary request as a text protocol line for SimpleCross::action().
+inline std::string shm_request_line(const shm_request_t& request){
+  char line[96];
+  switch (request.action){
+    case 'O':
+      snprintf(line, sizeof(line), "O %u %.8s %c %u %.5f%s", request.oid, request.symbol, request.side, request.qty, request.px,
+               shm_tif_field(request.tif));
+      break;
+    case 'X':
+      snprintf(line, sizeof(line), "X %u", request.oid);
+      break;
+    case 'R':
+      snprintf(line, sizeof(line), "R %u %u %.5f", request.oid, request.qty, request.px);
+      break;
+    case 'D':
+      snprintf(line, sizeof(line), "D %.8s %u", request.symbol, request.qty);
+      break;
+    default:
+      if (request.symbol[0] != '\0'){
+        snprintf(line, sizeof(line), "%c %.8s", request.action, request.symbol);
+      } else {
+        snprintf(line, sizeof(line), "%c", request.action);
+      }
+  }
+  return line;
+}
+
+#endif
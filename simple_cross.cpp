@@ -1,513 +1,486 @@
-/*
-SimpleCross - a process that matches internal orders
-
-Overview:
-    * Accept/remove orders as they are entered and keep a book of
-      resting orders
-    * Determine if an accepted order would be satisfied by previously
-      accepted orders (i.e. a buy would cross a resting sell)
-    * Output (print) crossing events and remove completed (fully filled)
-      orders from the book
-
-Inputs:
-    A string of space separated values representing an action.  The number of
-    values is determined by the action to be performed and have the following
-    format:
-
-    ACTION [OID [SYMBOL SIDE QTY PX]]
-
-    ACTION: single character value with the following definitions
-    O - place order, requires OID, SYMBOL, SIDE, QTY, PX
-    X - cancel order, requires OID
-    P - print sorted book (see example below)
-
-    OID: positive 32-bit integer value which must be unique for all orders
-
-    SYMBOL: alpha-numeric string value. Maximum length of 8.
-
-    SIDE: single character value with the following definitions
-    B - buy
-    S - sell
-
-    QTY: positive 16-bit integer value
-
-    PX: positive double precision value (7.5 format)
-
-Outputs:
-    A list of strings of space separated values that show the result of the
-    action (if any).  The number of values is determined by the result type and
-    have the following format:
-
-    RESULT OID [SYMBOL [SIDE] (FILL_QTY | OPEN_QTY) (FILL_PX | ORD_PX)]
-
-    RESULT: single character value with the following definitions
-    F - fill (or partial fill), requires OID, SYMBOL, FILL_QTY, FILL_PX
-    X - cancel confirmation, requires OID
-    P - book entry, requires OID, SYMBOL, SIDE, OPEN_QTY, ORD_PX (see example below)
-    E - error, requires OID. Remainder of line represents string value description of the error
-
-    FILL_QTY: positive 16-bit integer value representing qty of the order filled by
-              this crossing event
-
-    OPEN_QTY: positive 16-bit integer value representing qty of the order not yet filled
-
-    FILL_PX:  positive double precision value representing price of the fill of this
-              order by this crossing event (7.5 format)
-
-    ORD_PX:   positive double precision value representing original price of the order (7.5 format)
-              (7.5 format means up to 7 digits before the decimal and exactly 5 digits after the decimal)
-
-Conditions/Assumptions:
-    * The implementation should be a standalone Linux console application (include
-      source files, testing tools and Makefile in submission)
-    * The use of third party libraries is not permitted. 
-    * The app should respond to malformed input and other errors with a RESULT
-      of type 'E' and a descriptive error message
-    * Development should be production level quality. Design and
-      implementation choices should be documented
-	* Performance is always a concern in software, but understand that this is an unrealistic test. 
-	  Only be concerned about performance where it makes sense to the important sections of this application (i.e. reading actions.txt is not important).
-    * All orders are standard limit orders (a limit order means the order remains in the book until it
-      is either canceled, or fully filled by order(s) for its same symbol on the opposite side with an
-      equal or better price).
-    * Orders should be selected for crossing using price-time (FIFO) priority
-    * Orders for different symbols should not cross (i.e. the book must support multiple symbols)
-
-Example session:
-    INPUT                                   | OUTPUT
-    ============================================================================
-    "O 10000 IBM B 10 100.00000"            | results.size() == 0
-    "O 10001 IBM B 10 99.00000"             | results.size() == 0
-    "O 10002 IBM S 5 101.00000"             | results.size() == 0
-    "O 10003 IBM S 5 100.00000"             | results.size() == 2
-                                            | results[0] == "F 10003 IBM 5 100.00000"
-                                            | results[1] == "F 10000 IBM 5 100.00000"
-    "O 10004 IBM S 5 100.00000"             | results.size() == 2
-                                            | results[0] == "F 10004 IBM 5 100.00000"
-                                            | results[1] == "F 10000 IBM 5 100.00000"
-    "X 10002"                               | results.size() == 1
-                                            | results[0] == "X 10002"
-    "O 10005 IBM B 10 99.00000"             | results.size() == 0
-    "O 10006 IBM B 10 100.00000"            | results.size() == 0
-    "O 10007 IBM S 10 101.00000"            | results.size() == 0
-    "O 10008 IBM S 10 102.00000"            | results.size() == 0
-    "O 10008 IBM S 10 102.00000"            | results.size() == 1
-                                            | results[0] == "E 10008 Duplicate order id"
-    "O 10009 IBM S 10 102.00000"            | results.size() == 0
-    "P"                                     | results.size() == 6
-                                            | results[0] == "P 10009 IBM S 10 102.00000"
-                                            | results[1] == "P 10008 IBM S 10 102.00000"
-                                            | results[2] == "P 10007 IBM S 10 101.00000"
-                                            | results[3] == "P 10006 IBM B 10 100.00000"
-                                            | results[4] == "P 10001 IBM B 10 99.00000"
-                                            | results[5] == "P 10005 IBM B 10 99.00000"
-    "O 10010 IBM B 13 102.00000"            | results.size() == 4
-                                            | results[0] == "F 10010 IBM 10 101.00000"
-                                            | results[1] == "F 10007 IBM 10 101.00000"
-                                            | results[2] == "F 10010 IBM 3 102.00000"
-                                            | results[3] == "F 10008 IBM 3 102.00000"
-
-So, for the example actions.txt, the desired output from the application with the below main is:
-F 10003 IBM 5 100.00000
-F 10000 IBM 5 100.00000
-F 10004 IBM 5 100.00000
-F 10000 IBM 5 100.00000
-X 10002
-E 10008 Duplicate order id
-P 10009 IBM S 10 102.00000
-P 10008 IBM S 10 102.00000
-P 10007 IBM S 10 101.00000
-P 10006 IBM B 10 100.00000
-P 10001 IBM B 10 99.00000
-P 10005 IBM B 10 99.00000
-F 10010 IBM 10 101.00000
-F 10007 IBM 10 101.00000
-F 10010 IBM 3 102.00000
-F 10008 IBM 3 102.00000
-
-*/
-
-// Stub implementation and example driver for SimpleCross.
-// Your crossing logic should be accesible from the SimpleCross class.
-// Other than the signature of SimpleCross::action() you are free to modify as needed.
+// Example driver for SimpleCross: reads actions from a file (or stdin) and
+// prints the results, optionally in busy-poll mode, or serves clients over
+// TCP/Unix sockets or shared memory, optionally publishing market data,
+// journaling every action and checkpointing the book.
 #include <string>
 #include <fstream>
 #include <iostream>
-#include <list>
-#include <sstream>
-#include <map>
-#include <vector>
-#include <unordered_map>
-#include <typeinfo>
-
-typedef std::list<std::string> results_t;
-typedef std::vector<std::string> vlist_t;
-typedef std::map<double, std::map<int, std::string> > sub_book_t;
-typedef std::unordered_map<std::string, std::pair<sub_book_t, sub_book_t> > book_t;
-
-enum Inputs {
-  ACTION = 0, 
-  OID = 1,
-  SYMBOL = 2, 
-  SIDE = 3,
-  QTY = 4,
-  PX = 5
-};
-
-class SimpleCross
-{
-public:
-    results_t action(const std::string& line) {
-      results_t output, print_book;
-      std::pair<bool, results_t> err_check;
-      vlist_t split_line = this->split(line, ' ');
-      err_check = check_malformed_input(split_line);
-      if (!err_check.first){
-      book_t::const_iterator sub_book;
-      std::pair<sub_book_t, sub_book_t> book_pair;
-      int order_id;
-      switch (split_line[ACTION][0]){
-        case 'O':
-          order_id = std::stoi(split_line[OID]);
-          if (OIDs.find(order_id) == OIDs.end()){
-            OIDs[order_id] = line;
-            output = this->cross_order(line);
-          } else {
-            error_symbol = 'E';
-            output.push_back(error_symbol+" "+split_line[OID]+" "+"Duplicate order id");
-          }
-          break;
-        case 'P':
-          sub_book = book_main.begin();
-          while(sub_book != book_main.end()){
-            book_pair = sub_book->second;
-            print_book = this->print_book_pair(book_pair.first,book_pair.second);
-            for (std::string& order : print_book) {
-              order[0] = 'P';
-              output.push_back(order);
-            }
-            sub_book++;
-          }
-          break;
-        case 'X':
-          this->delete_from_book(line, book_main);
-          output.push_back(line);
-          break;
-        default:
-          error_symbol = 'E';
-          output.push_back(error_symbol+" "+"Incorrect action character");
+#include <thread>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "simple_cross.h"
+#include "run_options.h"
+#include "low_latency.h"
+#include "order_server.h"
+#include "uring_server.h"
+#include "shm_transport.h"
+#include "market_data.h"
+#include "journal.h"
+#include "checkpoint.h"
+#include "replay.h"
+
+// Ingest side of the busy-poll mode: non-blocking reads, spinning on EAGAIN,
+// framing lines into the ring for the matcher.
+template <size_t CAPACITY>
+void ingest_lines(int fd, spsc_ring_t<CAPACITY>& ring){
+  char buffer[64 * 1024];
+  std::string pending;
+  bool eof = false;
+  while (!eof){
+    ssize_t count = read(fd, buffer, sizeof(buffer));
+    if (count < 0 && (errno == EAGAIN || errno == EINTR)){
+      cpu_relax();
+      continue;
+    }
+    if (count <= 0){
+      eof = true;
+      if (pending.empty()){
+        break;
       }
-      } else {
-        output = err_check.second;
+      pending.push_back('\n');
+    } else {
+      pending.append(buffer, count);
+    }
+    size_t start = 0, newline;
+    while ((newline = pending.find('\n', start)) != std::string::npos){
+      line_slot_t* slot;
+      while ((slot = ring.claim()) == NULL){
+        cpu_relax();
       }
-      return output;
+      size_t length = newline - start;
+      slot->truncated = length > LINE_CAPACITY;
+      slot->length = slot->truncated ? 0 : length;
+      slot->end_of_input = false;
+      memcpy(slot->data, pending.data() + start, slot->length);
+      slot->enqueue_ns = now_ns();
+      ring.publish();
+      start = newline + 1;
     }
+    pending.erase(0, start);
+  }
+  line_slot_t* slot;
+  while ((slot = ring.claim()) == NULL){
+    cpu_relax();
+  }
+  slot->end_of_input = true;
+  ring.publish();
+}
 
-    std::pair<bool, results_t> check_malformed_input (const vlist_t& split_line) {
-      results_t output;
-      bool error_flag = false;
-      if (split_line[ACTION].length()!=1) {
-        error_symbol = 'E';
-        error_flag = true;
-        output.push_back(error_symbol+" "+"Malformed action input");
-      } else if (split_line[ACTION][0] == 'O'){
-        if (typeid(split_line[SYMBOL]) != typeid(std::string)){
-          error_symbol = 'E';
-          error_flag = true;
-          output.push_back(error_symbol+" "+"Malformed symbol input");
-        } else if (split_line[SYMBOL].length()>8){
-          error_symbol = 'E';
-          error_flag = true;
-          output.push_back(error_symbol+" "+"symbol input too long");
-        } else if (split_line[SIDE].length()!=1){
-          error_symbol = 'E';
-          error_flag = true;
-          output.push_back(error_symbol+" "+"Malformed side input");
-        }
+// In sync journal mode, waits until every action processed so far is durable
+// before its results may be written. False if the journal failed.
+bool release_results(journal_t* journal){
+  if (journal == NULL || !journal->holds_results()){
+    return true;
+  }
+  if (!journal->wait_durable(journal->sequence())){
+    std::cerr << "journal failed, results withheld" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Busy-poll run mode: pinned ingest and matcher threads, locked and pre-faulted
+// memory, spinning hand-off. Latency is measured from the moment a line is
+// framed by the ingest thread until its results are ready.
+int run_busy_poll(SimpleCross& scross, const run_options_t& opts, journal_t* journal, md_publisher_t* publisher){
+  typedef spsc_ring_t<4096> ring_t;
+  int fd = opts.input == "-" ? STDIN_FILENO : open(opts.input.c_str(), O_RDONLY);
+  if (fd < 0){
+    std::cerr << "cannot open " << opts.input << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  lock_memory();
+  std::unique_ptr<ring_t> ring(new ring_t());
+  ring->prefault();
+  scross.reserve(opts.prefault_orders);
+  prefault_heap(opts.prefault_orders * 128);
+  std::vector<uint64_t> samples;
+  samples.reserve(opts.report_latency ? opts.prefault_orders : 0);
+
+  std::thread ingest([&]() {
+    pin_current_thread(opts.ingest_cpu, "ingest");
+    ingest_lines(fd, *ring);
+  });
+  pin_current_thread(opts.match_cpu, "matcher");
+  std::string output;
+  while (true){
+    line_slot_t* slot = ring->front();
+    if (slot == NULL){
+      if (publisher != NULL){
+        publisher->poll_snapshots();
       }
-      return std::make_pair(error_flag, output);
+      cpu_relax();
+      continue;
     }
-
-    results_t cross_order (const std::string& line){
-      vlist_t split_line = this->split(line, ' ');
-      results_t buy_sell_result;
-      switch (split_line[SIDE][0]){
-        case 'B':
-          buy_sell_result = this->buy_cross(line);
-          break;
-        case 'S':
-          buy_sell_result = this->sell_cross(line);
-          break;
-        default:
-          error_symbol = 'E';
-          buy_sell_result.push_back(error_symbol+" "+"Incorrect side character");
+    if (slot->end_of_input){
+      ring->pop();
+      break;
+    }
+    results_t results;
+    if (slot->truncated){
+      results.push_back("E Line too long");
+    } else {
+      results = scross.action(std::string(slot->data, slot->length));
+    }
+    if (opts.report_latency){
+      samples.push_back(now_ns() - slot->enqueue_ns);
+    }
+    ring->pop();
+    for (results_t::const_iterator it=results.begin(); it!=results.end(); ++it){
+      output += *it;
+      output += '\n';
+    }
+    if (output.size() > 64 * 1024){
+      if (!release_results(journal)){
+        break;
       }
-      return buy_sell_result;
+      fwrite(output.data(), 1, output.size(), stdout);
+      output.clear();
     }
+  }
+  ingest.join();
+  if (!release_results(journal)){
+    return 1;
+  }
+  fwrite(output.data(), 1, output.size(), stdout);
+  fflush(stdout);
+  if (fd != STDIN_FILENO){
+    close(fd);
+  }
+  if (opts.report_latency){
+    report_latency("busy-poll", samples);
+  }
+  return 0;
+}
 
-    results_t buy_cross(const std::string& line){
-      results_t fulfilled;
-      vlist_t split_line = this->split(line, ' ');
-      std::string fulfilled_symbol;
-      fulfilled_symbol = 'F';
-      sub_book_t sell_book = book_main[split_line[SYMBOL]].second;
-      sub_book_t::const_iterator sell_iterator = sell_book.begin();
-      std::map<int, std::string> orders;
-      double price = std::stod(split_line[PX]);
-      int buy_quantity = std::stoi(split_line[QTY]);
-      while (sell_iterator->first<=price && buy_quantity>0 && sell_iterator != sell_book.end()){
-        results_t orders_strings;
-        orders = sell_iterator->second;
-        append_orders_for_key(orders, orders_strings);
-        for (std::string& order : orders_strings){
-          vlist_t split_order = this->split(order, ' ');
-          std::stringstream price_stream;
-          price_stream << std::fixed << std::setprecision(5) << std::stod(split_order[PX]);
-          int sell_quantity = std::stoi(split_order[QTY]);
-          if (sell_quantity>buy_quantity){
-            sell_quantity = sell_quantity - buy_quantity;
-            buy_quantity = 0;
-            split_order[QTY] = std::to_string(sell_quantity);
-            order = this->merge(split_order, ' ');
-            update_in_book(order, book_main);
-            fulfilled.push_back(fulfilled_symbol+" "+split_line[OID]+" "+split_line[SYMBOL]+" "+split_line[QTY]+" "+price_stream.str());
-            fulfilled.push_back(fulfilled_symbol+" "+split_order[OID]+" "+split_line[SYMBOL]+" "+split_line[QTY]+" "+price_stream.str());
-            break;
-          } else if (sell_quantity==buy_quantity) {
-            buy_quantity = 0;
-            this->delete_from_book(order,book_main);
-            fulfilled.push_back(fulfilled_symbol+" "+split_line[OID]+" "+split_line[SYMBOL]+" "+split_line[QTY]+" "+price_stream.str());
-            fulfilled.push_back(fulfilled_symbol+" "+split_order[OID]+" "+split_line[SYMBOL]+" "+split_line[QTY]+" "+price_stream.str());
-            break;
-          } else {
-            buy_quantity = buy_quantity - sell_quantity;
-            this->delete_from_book(order,book_main);
-            fulfilled.push_back(fulfilled_symbol+" "+split_line[OID]+" "+split_line[SYMBOL]+" "+split_order[QTY]+" "+price_stream.str());
-            fulfilled.push_back(fulfilled_symbol+" "+split_order[OID]+" "+split_line[SYMBOL]+" "+split_order[QTY]+" "+price_stream.str());
-          }
-        }
-        sell_iterator++;
-      }
-      if (buy_quantity) {
-        split_line[QTY] = std::to_string(buy_quantity);
-        std::string new_line = this->merge(split_line, ' ');
-        this->add_to_book(new_line, book_main);
-        }
-      return fulfilled;
+// Server mode: io_uring or epoll event loop until SIGINT/SIGTERM. A kernel
+// without the io_uring features we need falls back to epoll.
+int run_server(SimpleCross& scross, const run_options_t& opts, journal_t* journal, md_publisher_t* publisher){
+  std::string error;
+  install_server_signals();
+  if (opts.io_uring){
+    uring_server_t uring_server(scross);
+    uring_server.set_journal(journal);
+    uring_server.set_publisher(publisher);
+    uring_status_t status = uring_server.start(opts.listen, error);
+    if (status == URING_OK){
+      uring_server.run();
+      return 0;
+    }
+    if (status == URING_FAILED){
+      std::cerr << error << std::endl;
+      return 1;
     }
+    std::cerr << "io_uring unavailable (" << error << "), using epoll" << std::endl;
+    error.clear();
+  }
+  epoll_server_t server(scross);
+  server.set_journal(journal);
+  server.set_publisher(publisher);
+  if (!server.start(opts.listen, error)){
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  server.run();
+  return 0;
+}
 
-    results_t sell_cross(const std::string& line){
-      results_t fulfilled;
-      vlist_t split_line = this->split(line, ' ');
-      std::string fulfilled_symbol;
-      fulfilled_symbol = 'F';
-      sub_book_t buy_book = book_main[split_line[SYMBOL]].first;
-      sub_book_t::const_reverse_iterator buy_iterator = buy_book.rbegin();
-      std::map<int, std::string> orders;
-      double price = std::stod(split_line[PX]);
-      int sell_quantity = std::stoi(split_line[QTY]);
-      while (buy_iterator->first>=price && sell_quantity>0 && buy_iterator != buy_book.rend()){
-        results_t orders_strings;
-        orders = buy_iterator->second;
-        append_orders_for_key(orders, orders_strings);
-        for (std::string& order : orders_strings){
-          vlist_t split_order = this->split(order, ' ');
-          std::stringstream price_stream;
-          price_stream.str("");
-          price_stream << std::fixed << std::setprecision(5) << std::stod(split_line[PX]);
-          int buy_quantity = std::stoi(split_order[QTY]);
-          if (buy_quantity>sell_quantity){
-            buy_quantity = buy_quantity - sell_quantity;
-            sell_quantity = 0;
-            split_order[QTY] = std::to_string(buy_quantity);
-            order = this->merge(split_order, ' ');
-            update_in_book(order, book_main);
-            fulfilled.push_back(fulfilled_symbol+" "+split_line[OID]+" "+split_line[SYMBOL]+" "+split_line[QTY]+" "+price_stream.str());
-            fulfilled.push_back(fulfilled_symbol+" "+split_order[OID]+" "+split_line[SYMBOL]+" "+split_line[QTY]+" "+price_stream.str());
-            break;
-          } else if (sell_quantity==buy_quantity) {
-            sell_quantity = 0;
-            this->delete_from_book(order,book_main);
-            fulfilled.push_back(fulfilled_symbol+" "+split_line[OID]+" "+split_line[SYMBOL]+" "+split_line[QTY]+" "+price_stream.str());
-            fulfilled.push_back(fulfilled_symbol+" "+split_order[OID]+" "+split_line[SYMBOL]+" "+split_line[QTY]+" "+price_stream.str());
-            break;
-          } else {
-            sell_quantity = sell_quantity - buy_quantity;
-            this->delete_from_book(order,book_main);
-            fulfilled.push_back(fulfilled_symbol+" "+split_line[OID]+" "+split_line[SYMBOL]+" "+split_order[QTY]+" "+price_stream.str());
-            fulfilled.push_back(fulfilled_symbol+" "+split_order[OID]+" "+split_line[SYMBOL]+" "+split_order[QTY]+" "+price_stream.str());
-          }
-        }
-        buy_iterator++;
-      }
-      if (sell_quantity) {
-        split_line[QTY] = std::to_string(sell_quantity);
-        std::string new_line = this->merge(split_line, ' ');
-        this->add_to_book(new_line, book_main);
-        }
-      return fulfilled;
-    }
-    
-    void add_to_sub_book (const std::string& line, sub_book_t& book){
-      vlist_t split_line = this->split(line, ' ');
-      double price = std::stod(split_line[PX]);
-      int order_id = std::stoi(split_line[OID]);
-      if (book.find(price) == book.end()){
-        std::map<int, std::string> orders;
-        orders[order_id] = line;
-        book[price] = orders;
-      } else {
-        std::map<int, std::string> orders = book[price];
-        orders[order_id] = line;
-        book[price] = orders;
+// Shared-memory mode: the matcher polls the request ring until SIGINT/SIGTERM.
+int run_shm_server(SimpleCross& scross, const run_options_t& opts, journal_t* journal, md_publisher_t* publisher){
+  std::string error;
+  shm_region_t* region = shm_create(opts.shm_name, error);
+  if (region == NULL){
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  install_server_signals();
+  pin_current_thread(opts.match_cpu, "matcher");
+  session_router_t router(scross);
+  router.set_journal(journal);
+  shm_request_t request;
+  unsigned spins = 0;
+  while (!server_stop_requested){
+    if (!shm_try_pop_request(region, request)){
+      if (publisher != NULL){
+        publisher->poll_snapshots();
       }
+      shm_wait(spins);
+      continue;
     }
-
-    void add_to_book (const std::string& line, book_t& book){
-      vlist_t split_line = this->split(line, ' ');    
-      if (book.find(split_line[SYMBOL]) == book.end()){
-        sub_book_t sub_book;
-        book[split_line[SYMBOL]] = std::make_pair(sub_book,sub_book);
-        switch (split_line[SIDE][0]){
-          case 'B':
-            this->add_to_sub_book(line, book[split_line[SYMBOL]].first);
-            break;
-          case 'S':
-            this->add_to_sub_book(line, book[split_line[SYMBOL]].second);
-            break;
-        }
+    spins = 0;
+    if (request.client >= SHM_MAX_CLIENTS){
+      continue;
+    }
+    // Only the requester's own records may wait for room: a client that is
+    // not reading must never block the matcher.
+    auto deliver = [&](uint32_t slot, const std::string& result){
+      if (slot == request.client){
+        shm_push_response(region, slot, request.sequence, result, false);
       } else {
-        switch (split_line[SIDE][0]){
-          case 'B':
-            this->add_to_sub_book(line, book[split_line[SYMBOL]].first);
-            break;
-          case 'S':
-            this->add_to_sub_book(line, book[split_line[SYMBOL]].second);
-            break;
-        }
+        shm_try_push_response(region, slot, result);
       }
-    }
-
-    void delete_from_book (const std::string& line, book_t& book){
-      vlist_t split_line = this->split(line, ' ');
-      int order_id = std::stoi(split_line[OID]);
-      std::string order = OIDs[order_id];
-      vlist_t split_order = this->split(order, ' ');
-      double price = std::stod(split_order[PX]);
-      std::map<int, std::string> orders;
-      switch (split_order[SIDE][0]){
-        case 'B':
-          orders = book[split_order[SYMBOL]].first[price];
-          orders.erase(order_id);
-          book[split_order[SYMBOL]].first[price] = orders;
-          break;
-        case 'S':
-          orders = book[split_order[SYMBOL]].second[price];
-          orders.erase(order_id);
-          book[split_order[SYMBOL]].second[price] = orders;
-          break;
+    };
+    router.dispatch(request.client, shm_request_line(request), [&](uint64_t client, const std::string& result){
+      if (client != EVERY_SESSION){
+        deliver(client, result);
+        return;
       }
-    }
-
-    void update_in_book (const std::string& line, book_t& book){
-      vlist_t split_line = this->split(line, ' ');
-      int order_id = std::stoi(split_line[OID]);
-      std::string order = OIDs[order_id];
-      vlist_t split_order = this->split(order, ' ');
-      double price = std::stod(split_order[PX]);
-      std::map<int, std::string> orders;
-      switch (split_order[SIDE][0]){
-        case 'B':
-          orders = book[split_order[SYMBOL]].first[price];
-          orders[order_id] = line;
-          book[split_order[SYMBOL]].first[price] = orders;
-          break;
-        case 'S':
-          orders = book[split_order[SYMBOL]].second[price];
-          orders[order_id] = line;
-          book[split_order[SYMBOL]].second[price] = orders;
-          break;
+      for (uint32_t slot = 0; slot < SHM_MAX_CLIENTS; slot++){
+        deliver(slot, result);
       }
-    }
+    });
+    shm_push_response(region, request.client, request.sequence, "", true);
+  }
+  shm_detach(region);
+  shm_unlink(shm_path(opts.shm_name).c_str());
+  return 0;
+}
 
-    results_t print_book_pair (sub_book_t buy_book, sub_book_t sell_book){
-      sub_book_t::const_iterator buy_iterator = buy_book.begin();
-      sub_book_t::const_iterator sell_iterator = sell_book.begin();
-      results_t all_sorted;
-      std::map<int, std::string> orders;
-      while (buy_iterator != buy_book.end() && sell_iterator != sell_book.end()){
-        if(buy_iterator->first<=sell_iterator->first){
-          orders = buy_iterator->second;
-          append_orders_for_key(orders, all_sorted);
-          buy_iterator++;
-        } else {
-          orders = sell_iterator->second;
-          append_orders_for_key(orders, all_sorted);
-          sell_iterator++;
-        }
+// execute() sink writing each result line straight to stdout.
+struct stdout_sink_t {
+  void operator()(const char* text, size_t length){
+    std::cout.write(text, length);
+    std::cout.put('\n');
+  }
+};
+
+// Line reader for the blocking mode with a market data publisher: reads the
+// input fd itself, so that it can wait for input and snapshot requests
+// together. Lines are split like getline() splits them.
+struct serving_reader_t {
+  serving_reader_t(int input_fd, md_publisher_t& md_publisher) : fd(input_fd), publisher(md_publisher), start(0), eof(false) {}
+
+  bool next(std::string& line){
+    size_t newline;
+    while ((newline = buffer.find('\n', start)) == std::string::npos && !eof){
+      buffer.erase(0, start);
+      start = 0;
+      struct pollfd waiting[2] = {{fd, POLLIN, 0}, {publisher.snapshot_socket(), POLLIN, 0}};
+      if (poll(waiting, 2, -1) < 0){
+        eof = errno != EINTR;
+        continue;
       }
-      while (buy_iterator != buy_book.end()){
-        orders = buy_iterator->second;
-        append_orders_for_key(orders, all_sorted);
-        buy_iterator++;
+      if (waiting[1].revents & POLLIN){
+        publisher.serve_snapshots();
       }
-      while (sell_iterator != sell_book.end()){
-        orders = sell_iterator->second;
-        append_orders_for_key(orders, all_sorted);
-        sell_iterator++;
+      if (waiting[0].revents & (POLLIN | POLLHUP | POLLERR)){
+        char chunk[64 * 1024];
+        ssize_t count = read(fd, chunk, sizeof(chunk));
+        if (count > 0){
+          buffer.append(chunk, count);
+        } else {
+          eof = count == 0 || (errno != EINTR && errno != EAGAIN);
+        }
       }
-      all_sorted.reverse();
-      return all_sorted;
     }
-
-    void append_orders_for_key (std::map<int, std::string>& orders, results_t& order_list){
-      for (std::map<int, std::string>::const_iterator order_iterator = orders.begin(); order_iterator != orders.end(); order_iterator++){
-        order_list.push_back(order_iterator->second);
+    if (newline == std::string::npos){
+      if (start == buffer.size()){
+        return false;
       }
+      newline = buffer.size();
     }
+    line.assign(buffer, start, newline - start);
+    start = std::min(newline + 1, buffer.size());
+    return true;
+  }
+
+  int fd;
+  md_publisher_t& publisher;
+  std::string buffer;
+  size_t start;
+  bool eof;
+};
 
-    vlist_t split(std::string line, char delimiter){
-      std::string temp_holder;
-      std::stringstream ss(line);
-      vlist_t string_array;
-      while (getline(ss, temp_holder, delimiter)){
-        string_array.push_back(temp_holder);
+// Default run mode: blocking reads, one action per line. Without a journal
+// or checkpoints nothing needs the results as a list, so they are streamed
+// to stdout as the engine produces them (a P of a large book is never held
+// in memory). With a publisher, reads go through serving_reader_t.
+int run_blocking(SimpleCross& scross, const run_options_t& opts, journal_t* journal, md_publisher_t* publisher){
+  std::string line;
+  std::ifstream actions_file;
+  int fd = -1;
+  if (publisher != NULL){
+    fd = opts.input == "-" ? STDIN_FILENO : open(opts.input.c_str(), O_RDONLY);
+    if (fd < 0){
+      std::cerr << "cannot open " << opts.input << ": " << strerror(errno) << std::endl;
+      return 1;
+    }
+  } else if (opts.input != "-"){
+    actions_file.open(opts.input.c_str(), std::ios::in);
+  }
+  std::istream& actions = opts.input == "-" ? std::cin : actions_file;
+  std::unique_ptr<serving_reader_t> reader(publisher != NULL ? new serving_reader_t(fd, *publisher) : NULL);
+  std::vector<uint64_t> samples;
+  bool stream = journal == NULL && opts.checkpoint.empty();
+  stdout_sink_t sink;
+  while (reader ? reader->next(line) : (bool)std::getline(actions, line))
+  {
+    uint64_t start = opts.report_latency ? now_ns() : 0;
+    if (stream){
+      scross.execute(line.data(), line.size(), sink);
+      std::cout.flush();
+      if (opts.report_latency){
+        samples.push_back(now_ns() - start);
       }
-      return string_array;
+      continue;
+    }
+    results_t results = scross.action(line);
+    if (opts.report_latency){
+      samples.push_back(now_ns() - start);
+    }
+    if (!release_results(journal)){
+      return 1;
     }
+    for (results_t::const_iterator it=results.begin(); it!=results.end(); ++it)
+    {
+      std::cout << *it << std::endl;
+    }
+  }
+  if (fd > STDIN_FILENO){
+    close(fd);
+  }
+  if (opts.report_latency){
+    report_latency("blocking", samples);
+  }
+  return 0;
+}
 
-    std::string merge(const vlist_t& split_line, char delimiter){
-      vlist_t _split_line = split_line;
-      std::string line;
-      std::stringstream price_stream;
-      price_stream.str("");
-      price_stream << std::fixed << std::setprecision(5) << std::stod(split_line[PX]);
-      _split_line.pop_back();
-      for (std::string chunk : _split_line){
-        line = line + chunk + delimiter;
-      }
-      line = line + price_stream.str();
-      return line;
+// Replay mode: runs a whole journal through a fresh engine at full speed and
+// checks every action's results against the recorded ones.
+int run_replay(const run_options_t& opts){
+  SimpleCross scross;
+  replay_report_t report;
+  std::string error;
+  if (!replay_journal(scross, opts.replay, report, error)){
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  char hash[64];
+  snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)report.session_hash);
+  std::cerr << "replayed " << report.actions << " actions, " << report.results << " results in " << report.seconds << " s ("
+            << (uint64_t)(report.actions / std::max(report.seconds, 1e-9)) << " actions/s), result hash " << hash << std::endl;
+  if (report.torn_tail){
+    std::cerr << "journal ends in a torn record, replayed up to it" << std::endl;
+  }
+  if (report.mismatched > 0){
+    std::cerr << report.mismatched << " actions produced different results than recorded, first at action "
+              << report.first_mismatch << std::endl;
+    return 1;
+  }
+  std::cerr << "results match the journal" << std::endl;
+  return 0;
+}
+
+// `publisher` is NULL without --md-multicast; otherwise every mode also
+// answers its snapshot requests while waiting for input.
+int run(SimpleCross& scross, const run_options_t& opts, journal_t* journal, md_publisher_t* publisher){
+    if (!opts.shm_name.empty()){
+        return run_shm_server(scross, opts, journal, publisher);
     }
-private:
-    book_t book_main;
-    std::string error_symbol;
-    std::unordered_map<int, std::string> OIDs;
-};
+    if (!opts.listen.empty()){
+        return run_server(scross, opts, journal, publisher);
+    }
+    if (opts.busy_poll){
+        return run_busy_poll(scross, opts, journal, publisher);
+    }
+    return run_blocking(scross, opts, journal, publisher);
+}
 
 int main(int argc, char **argv)
 {
+    run_options_t opts;
+    std::string error;
+    if (!parse_run_options(argc, argv, opts, error)){
+        std::cerr << error << std::endl;
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!opts.replay.empty()){
+        return run_replay(opts);
+    }
     SimpleCross scross;
-    std::string line;
-    std::ifstream actions("actions.txt", std::ios::in);
-    while (std::getline(actions, line))
-    {
-        results_t results = scross.action(line);
-        for (results_t::const_iterator it=results.begin(); it!=results.end(); ++it)
-        {
-            std::cout << *it << std::endl;
+    uint64_t sequence = 0;
+    if (!opts.book_file.empty()){
+        if (!scross.map_book(opts.book_file, error)){
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        sequence = scross.sequence();
+        if (sequence > 0){
+            std::cerr << "mapped book " << opts.book_file << " as of action " << sequence << std::endl;
+        }
+    }
+    scross.set_book_deltas(opts.deltas);
+    if (!recover_engine(scross, opts.checkpoint, opts.journal, sequence, error)){
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    journal_t journal;
+    if (!opts.journal.empty()){
+        if (!journal.open(opts.journal, opts.journal_mode, opts.journal_interval_us, opts.journal_batch, sequence + 1, opts.deltas, error)){
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        scross.set_action_log(&journal);
+    }
+    checkpointer_t checkpointer(scross);
+    if (!opts.checkpoint.empty()){
+        checkpointer.start(opts.checkpoint, opts.checkpoint_every, sequence, opts.journal.empty() ? NULL : &journal);
+        scross.set_action_log(&checkpointer);
+    }
+    md_publisher_t publisher;
+    if (!opts.md_multicast.empty()){
+        if (!publisher.open(opts.md_multicast, opts.md_interface, error)){
+            std::cerr << error << std::endl;
+            return 1;
         }
+        publisher.load_book(scross);
+        scross.set_listener(&publisher);
+    }
+#ifdef SIMPLE_CROSS_TRACE
+    if (!opts.trace.empty() && !trace_start(opts.trace, opts.trace_sample, error)){
+        std::cerr << error << std::endl;
+        return 1;
+    }
+#endif
+    int status = run(scross, opts, opts.journal.empty() ? NULL : &journal, opts.md_multicast.empty() ? NULL : &publisher);
+#ifdef SIMPLE_CROSS_TRACE
+    if (!opts.trace.empty()){
+        std::cerr << trace_stop();
+    }
+#endif
+#ifdef SIMPLE_CROSS_LATENCY
+    if (opts.report_latency){
+        std::cerr << scross.latency_report();
+    }
+#endif
+#ifdef SIMPLE_CROSS_PROBES
+    if (opts.report_latency){
+        std::cerr << probe_report();
     }
-    return 0;
+#endif
+#ifdef SIMPLE_CROSS_ALLOCS
+    if (opts.report_latency){
+        std::cerr << scross.allocation_report();
+    }
+#endif
+    if (!opts.journal.empty()){
+        journal.close();
+        status = journal.ok() ? status : 1;
+    }
+    if (!opts.checkpoint.empty() && !checkpointer.finish()){
+        status = 1;
+    }
+    if (!opts.book_file.empty() && !scross.sync_book()){
+        std::cerr << "cannot write back book " << opts.book_file << std::endl;
+        status = 1;
+    }
+    if (!opts.md_multicast.empty()){
+        std::cout << std::flush;
+        publisher.end_session();
+    }
+    return status;
 }
-
@@ -0,0 +1,1792 @@
+/*
+SimpleCross - a process that matches internal orders
+
+Overview:
+    * Accept/remove orders as they are entered and keep a book of
+      resting orders
+    * Determine if an accepted order would be satisfied by previously
+      accepted orders (i.e. a buy would cross a resting sell)
+    * Output (print) crossing events and remove completed (fully filled)
+      orders from the book
+
+Inputs:
+    A string of space separated values representing an action.  The number of
+    values is determined by the action to be performed and have the following
+    format:
+
+    ACTION [OID [SYMBOL SIDE QTY PX [TIF]]]
+
+    ACTION: single character value with the following definitions
+    O - place order, requires OID, SYMBOL, SIDE, QTY, PX; optional TIF
+    X - cancel order, requires OID
+    R - amend order, requires OID, QTY, PX: less quantity at the same price
+        keeps the order's priority, anything else re-enters it at the back
+    P - print sorted book (see example below); "P SYMBOL" prints one symbol
+    S - engine statistics: counters, pool usage, per symbol and side resting
+        orders and levels (and latency percentiles when compiled in);
+        "S shape" reports the memory footprint and shape of every book
+    Q - best bid and offer of a symbol, requires SYMBOL
+    D - aggregated depth, requires SYMBOL and N: the best N price levels of
+        each side
+
+    OID: positive 32-bit integer value which must be unique for all orders
+
+    SYMBOL: alpha-numeric string value. Maximum length of 8.
+
+    SIDE: single character value with the following definitions
+    B - buy
+    S - sell
+
+    QTY: positive 16-bit integer value
+
+    PX: positive double precision value (7.5 format)
+
+    TIF: time in force, one of
+    DAY - rest whatever does not cross (the default)
+    IOC - immediate or cancel: cross, then cancel the remainder
+    FOK - fill or kill: fill completely at once or cancel without trading
+
+Outputs:
+    A list of strings of space separated values that show the result of the
+    action (if any).  The number of values is determined by the result type and
+    have the following format:
+
+    RESULT OID [SYMBOL [SIDE] (FILL_QTY | OPEN_QTY) (FILL_PX | ORD_PX)]
+
+    RESULT: single character value with the following definitions
+    F - fill (or partial fill), requires OID, SYMBOL, FILL_QTY, FILL_PX
+    X - cancel confirmation, requires OID; also ends an IOC or FOK order
+        that leaves quantity unfilled
+    R - amend confirmation: R OID QTY PX, followed by any fills of the
+        amended order
+    P - book entry, requires OID, SYMBOL, SIDE, OPEN_QTY, ORD_PX (see example below)
+    E - error, requires OID. Remainder of line represents string value description of the error
+    S - statistics line, the answer to an S action (see SimpleCross::print_stats())
+    Q - quote, the answer to a Q action: Q SYMBOL BID_QTY BID_PX ASK_QTY ASK_PX
+        with the total open quantity at each best price; an empty side shows
+        as 0 0.00000
+    D - depth level, the answer to a D action: D SYMBOL SIDE QTY PX ORDERS, the
+        bids best first and then the asks best first
+    L - level delta, after the results of an action that changed the book
+        when level deltas are on (SimpleCross::set_book_deltas()):
+        L A|U|D SYMBOL SIDE QTY PX ORDERS, a level added, updated or deleted
+        with its new total open quantity and order count (0 0 when deleted)
+    B - order delta, the same for order deltas: B A|M|R OID SYMBOL SIDE QTY PX,
+        an order added, modified or removed with its new open quantity
+        (0 when removed)
+
+    FILL_QTY: positive 16-bit integer value representing qty of the order filled by
+              this crossing event
+
+    OPEN_QTY: positive 16-bit integer value representing qty of the order not yet filled
+
+    FILL_PX:  positive double precision value representing price of the fill of this
+              order by this crossing event (7.5 format)
+
+    ORD_PX:   positive double precision value representing original price of the order (7.5 format)
+              (7.5 format means up to 7 digits before the decimal and exactly 5 digits after the decimal)
+
+Conditions/Assumptions:
+    * The implementation should be a standalone Linux console application (include
+      source files, testing tools and Makefile in submission)
+    * The use of third party libraries is not permitted. 
+    * The app should respond to malformed input and other errors with a RESULT
+      of type 'E' and a descriptive error message
+    * Development should be production level quality. Design and
+      implementation choices should be documented
+	* Performance is always a concern in software, but understand that this is an unrealistic test. 
+	  Only be concerned about performance where it makes sense to the important sections of this application (i.e. reading actions.txt is not important).
+    * All orders are standard limit orders (a limit order means the order remains in the book until it
+      is either canceled, or fully filled by order(s) for its same symbol on the opposite side with an
+      equal or better price).
+    * Orders should be selected for crossing using price-time (FIFO) priority
+    * Orders for different symbols should not cross (i.e. the book must support multiple symbols)
+
+Example session:
+    INPUT                                   | OUTPUT
+    ============================================================================
+    "O 10000 IBM B 10 100.00000"            | results.size() == 0
+    "O 10001 IBM B 10 99.00000"             | results.size() == 0
+    "O 10002 IBM S 5 101.00000"             | results.size() == 0
+    "O 10003 IBM S 5 100.00000"             | results.size() == 2
+                                            | results[0] == "F 10003 IBM 5 100.00000"
+                                            | results[1] == "F 10000 IBM 5 100.00000"
+    "O 10004 IBM S 5 100.00000"             | results.size() == 2
+                                            | results[0] == "F 10004 IBM 5 100.00000"
+                                            | results[1] == "F 10000 IBM 5 100.00000"
+    "X 10002"                               | results.size() == 1
+                                            | results[0] == "X 10002"
+    "O 10005 IBM B 10 99.00000"             | results.size() == 0
+    "O 10006 IBM B 10 100.00000"            | results.size() == 0
+    "O 10007 IBM S 10 101.00000"            | results.size() == 0
+    "O 10008 IBM S 10 102.00000"            | results.size() == 0
+    "O 10008 IBM S 10 102.00000"            | results.size() == 1
+                                            | results[0] == "E 10008 Duplicate order id"
+    "O 10009 IBM S 10 102.00000"            | results.size() == 0
+    "P"                                     | results.size() == 6
+                                            | results[0] == "P 10009 IBM S 10 102.00000"
+                                            | results[1] == "P 10008 IBM S 10 102.00000"
+                                            | results[2] == "P 10007 IBM S 10 101.00000"
+                                            | results[3] == "P 10006 IBM B 10 100.00000"
+                                            | results[4] == "P 10001 IBM B 10 99.00000"
+                                            | results[5] == "P 10005 IBM B 10 99.00000"
+    "O 10010 IBM B 13 102.00000"            | results.size() == 4
+                                            | results[0] == "F 10010 IBM 10 101.00000"
+                                            | results[1] == "F 10007 IBM 10 101.00000"
+                                            | results[2] == "F 10010 IBM 3 102.00000"
+                                            | results[3] == "F 10008 IBM 3 102.00000"
+
+So, for the example actions.txt, the desired output from the application with the below main is:
+F 10003 IBM 5 100.00000
+F 10000 IBM 5 100.00000
+F 10004 IBM 5 100.00000
+F 10000 IBM 5 100.00000
+X 10002
+E 10008 Duplicate order id
+P 10009 IBM S 10 102.00000
+P 10008 IBM S 10 102.00000
+P 10007 IBM S 10 101.00000
+P 10006 IBM B 10 100.00000
+P 10001 IBM B 10 99.00000
+P 10005 IBM B 10 99.00000
+F 10010 IBM 10 101.00000
+F 10007 IBM 10 101.00000
+F 10010 IBM 3 102.00000
+F 10008 IBM 3 102.00000
+
+*/
+#ifndef SIMPLE_CROSS_H
+#define SIMPLE_CROSS_H
+
+// Crossing logic is accessible from the SimpleCross class.
+// Other than the signature of SimpleCross::action() you are free to modify as needed.
+//
+// Book layout:
+//     * prices are integer counts of 1/PX_SCALE (the resolution of the 7.5
+//       output format), so levels compare exactly and print without
+//       floating point; input prices are rounded to 5 decimals on entry
+//     * resting orders live in one pool (order_t) and are linked by pool
+//       index, per price level, in priority order
+//     * each side of a symbol keeps its levels (level_t) in a sorted vector
+//       with the best price at the back, so matching works at the cheap end
+//     * order ids map to pool indices through a flat open-addressing table;
+//       ids stay in it after the order leaves the book (RETIRED_ORDER) so
+//       duplicates are still rejected
+//     * the pool, the id table and the symbol names are mapped_array_t, so
+//       map_book() can keep them in files that survive a restart; the level
+//       vectors and symbol lookup are derived and rebuilt from them
+// The hot path is execute(), which parses the line in place and hands every
+// result line to a sink as a (pointer, length) pair; action() wraps it for
+// callers that want a results_t.
+#include <string>
+#include <list>
+#include <sstream>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#include "mapped_array.h"
+#ifdef SIMPLE_CROSS_LATENCY
+#include "latency_histogram.h"
+#endif
+#ifdef SIMPLE_CROSS_ALLOCS
+#include "alloc_counter.h"
+#endif
+#ifdef SIMPLE_CROSS_PROBES
+#include "probes.h"
+#else
+#define PROBE_SPAN(stage)
+#endif
+#ifdef SIMPLE_CROSS_TRACE
+#include "trace.h"
+#else
+#define TRACE_ACTION(sequence)
+#define TRACE_SPAN(name)
+#define TRACE_INSTANT(...)
+#endif
+
+typedef std::list<std::string> results_t;
+typedef std::vector<std::string> vlist_t;
+
+enum Inputs {
+  ACTION = 0,
+  OID = 1,
+  SYMBOL = 2,
+  SIDE = 3,
+  QTY = 4,
+  PX = 5,
+  TIF = 6
+};
+
+enum time_in_force_t {
+  TIF_DAY = 0,
+  TIF_IOC,
+  TIF_FOK
+};
+
+// How an action was handled, for per-kind statistics.
+enum action_kind_t {
+  ACTION_PASSIVE = 0,   // order that rested without trading
+  ACTION_CROSSING,      // order that traded
+  ACTION_KILLED,        // IOC or FOK order cancelled without trading
+  ACTION_CANCEL,
+  ACTION_PRINT,
+  ACTION_STATS,
+  ACTION_QUERY,         // Q and D
+  ACTION_AMEND,         // R
+  ACTION_REJECTED,      // answered with an E result
+  ACTION_KINDS
+};
+
+const char* const ACTION_KIND_NAMES[ACTION_KINDS] = {"O passive", "O crossing", "O killed", "X", "P", "S", "Q/D", "R", "rejected"};
+
+const int64_t PX_SCALE = 100000;
+const uint32_t NO_ORDER = 0xffffffff;
+const uint32_t NO_BOOK = 0xffffffff;
+const uint32_t RETIRED_ORDER = 0xfffffffe;
+
+// A resting order, or a free pool entry (side 0, linked through `next`).
+struct order_t {
+  int64_t px;
+  int32_t oid;
+  int32_t qty;          // open quantity
+  uint32_t prev;
+  uint32_t next;
+  uint32_t book;        // index of the symbol's book
+  char side;
+};
+
+// A price level: its orders from head (first in priority) to tail, with the
+// total open quantity.
+struct level_t {
+  int64_t px;
+  int64_t qty;
+  uint32_t count;
+  uint32_t head;
+  uint32_t tail;
+};
+
+// Bids sorted by ascending price, asks by descending price: best at the back.
+typedef std::vector<level_t> side_book_t;
+
+struct symbol_book_t {
+  std::string symbol;
+  side_book_t bids;
+  side_book_t asks;
+  uint32_t bid_orders = 0;
+  uint32_t ask_orders = 0;
+  int64_t bid_qty = 0;  // open quantity over all levels of the side
+  int64_t ask_qty = 0;
+};
+
+// Best bid and offer of a symbol: price (in 1/PX_SCALE units), total open
+// quantity and order count of the best level of each side; quantity 0 when a
+// side is empty.
+struct bbo_t {
+  int64_t bid_px;
+  int64_t bid_qty;
+  uint32_t bid_orders;
+  int64_t ask_px;
+  int64_t ask_qty;
+  uint32_t ask_orders;
+};
+
+// One aggregated price level: price (1/PX_SCALE units), total open quantity
+// and number of orders.
+struct depth_level_t {
+  int64_t px;
+  int64_t qty;
+  uint32_t orders;
+};
+
+// Book change events appended to an action's results.
+enum book_deltas_t {
+  DELTAS_NONE = 0,
+  DELTAS_LEVEL,         // L lines: aggregated price levels
+  DELTAS_ORDER          // B lines: individual orders
+};
+
+// Counters kept by the engine since it was created in this process.
+struct engine_stats_t {
+  uint64_t actions[ACTION_KINDS];   // by how they were handled
+  uint64_t trades;                  // resting orders hit (two F lines each)
+  uint64_t traded_qty;
+  uint64_t resting;                 // orders in the book now
+};
+
+// Persistent form of a symbol; books are numbered in order of first use.
+struct symbol_name_t {
+  char text[8];         // NUL padded
+};
+
+// Order id -> pool index (or RETIRED_ORDER). Linear probing over a power of
+// two table kept at most half full; ids are never removed.
+class oid_index_t
+{
+public:
+    oid_index_t() : shift(60) {
+      slots.resize(16, slot_t{0, NO_ORDER});
+    }
+
+    // Keeps the table in the file at path (see mapped_array_t::open()).
+    bool open(const std::string& path, bool& created, std::string& error){
+      if (!slots.open(path, created, error)){
+        return false;
+      }
+      if (slots.size() < 16 || (slots.size() & (slots.size() - 1)) != 0){
+        error = "File " + path + " does not hold an order id table";
+        return false;
+      }
+      set_shift();
+      return true;
+    }
+
+    bool sync(){
+      return slots.sync();
+    }
+
+    // The value stored for oid, or NULL if the id was never used.
+    uint32_t* find(int32_t oid){
+      for (size_t i = position(oid); ; i = (i + 1) & (slots.size() - 1)){
+        if (slots[i].value == NO_ORDER){
+          return NULL;
+        }
+        if (slots[i].oid == oid){
+          return &slots[i].value;
+        }
+      }
+    }
+
+    // Adds oid with value RETIRED_ORDER; returns its value slot, or NULL if
+    // the id is already present.
+    uint32_t* insert(int32_t oid){
+      if ((used() + 1) * 2 > slots.size()){
+        grow(slots.size() * 2);
+      }
+      size_t i = position(oid);
+      for (; slots[i].value != NO_ORDER; i = (i + 1) & (slots.size() - 1)){
+        if (slots[i].oid == oid){
+          return NULL;
+        }
+      }
+      slots[i].oid = oid;
+      slots[i].value = RETIRED_ORDER;
+      used()++;
+      return &slots[i].value;
+    }
+
+    void reserve(size_t count){
+      size_t capacity = slots.size();
+      while (capacity < count * 2){
+        capacity *= 2;
+      }
+      if (capacity != slots.size()){
+        grow(capacity);
+      }
+    }
+
+    // Ids ever used, and slots in the table.
+    size_t count(){
+      return used();
+    }
+
+    size_t capacity() const {
+      return slots.size();
+    }
+
+    // Calls visit(oid, value) for every id, in table order.
+    template <typename Visit>
+    void for_each(Visit visit) const {
+      for (const slot_t& slot : slots){
+        if (slot.value != NO_ORDER){
+          visit(slot.oid, slot.value);
+        }
+      }
+    }
+private:
+    struct slot_t {
+      int32_t oid;
+      uint32_t value;
+    };
+
+    size_t position(int32_t oid) const {
+      return ((uint64_t)(uint32_t)oid * 0x9e3779b97f4a7c15ULL) >> shift;
+    }
+
+    uint64_t& used(){
+      return slots.word(0);
+    }
+
+    void set_shift(){
+      shift = 64;
+      for (size_t size = slots.size(); size > 1; size >>= 1){
+        shift--;
+      }
+    }
+
+    void grow(size_t capacity){
+      std::vector<slot_t> old(slots.begin(), slots.end());
+      slots.resize(0, slot_t{0, NO_ORDER});
+      slots.resize(capacity, slot_t{0, NO_ORDER});
+      set_shift();
+      for (const slot_t& slot : old){
+        if (slot.value != NO_ORDER){
+          size_t i = position(slot.oid);
+          while (slots[i].value != NO_ORDER){
+            i = (i + 1) & (slots.size() - 1);
+          }
+          slots[i] = slot;
+        }
+      }
+    }
+
+    mapped_array_t<slot_t> slots;
+    int shift;
+};
+
+// Observer of every change to the resting book, e.g. a market data publisher.
+// Quantities are open quantities of the resting order; the default
+// implementations ignore the event.
+class book_listener_t
+{
+public:
+    virtual ~book_listener_t() {}
+    // A new order rests in the book.
+    virtual void order_added(const std::string& symbol, char side, int oid, double px, int qty) {}
+    // A resting order was partially filled; its open qty went from old_qty to qty.
+    virtual void order_modified(const std::string& symbol, char side, int oid, double px, int old_qty, int qty) {}
+    // A resting order left the book (fully filled or cancelled) with qty open.
+    virtual void order_removed(const std::string& symbol, char side, int oid, double px, int qty) {}
+    // An incoming order traded qty against a resting order at px.
+    virtual void trade(const std::string& symbol, double px, int qty) {}
+    // Called at the end of every action, after all of its book changes.
+    virtual void action_done() {}
+};
+
+// Receives every action line together with the results it produced, e.g. a
+// journal.
+class action_log_t
+{
+public:
+    virtual ~action_log_t() {}
+    virtual void record(const std::string& line, const results_t& results) = 0;
+};
+
+class SimpleCross
+{
+public:
+    SimpleCross() : listener(NULL), action_log(NULL), counters(), delta_mode(DELTAS_NONE) {
+      free_orders() = NO_ORDER;
+    }
+
+    // Registers the observer of book changes; NULL detaches it.
+    void set_listener(book_listener_t* book_listener){
+      listener = book_listener;
+    }
+
+    // Makes every action that changes the book follow its results with the
+    // changes, as L (level) or B (order) lines; see the header comment.
+    // Successive changes to one level within an action are merged into one
+    // line carrying the final state.
+    void set_book_deltas(book_deltas_t mode){
+      delta_mode = mode;
+      deltas.clear();
+      deltas.reserve(256);
+    }
+
+    book_deltas_t book_deltas() const {
+      return delta_mode;
+    }
+
+    // Registers the recorder of actions and results; NULL detaches it. Only
+    // action() records; execute() callers keep their own record.
+    void set_action_log(action_log_t* log){
+      action_log = log;
+    }
+
+    results_t action(const std::string& line) {
+      results_t output;
+      result_list_t sink(output);
+      execute(line.data(), line.size(), sink);
+      if (action_log != NULL){
+        action_log->record(line, output);
+      }
+      return output;
+    }
+
+    // Runs one action line (without its newline) and calls
+    // sink(const char* text, size_t length) for every result line, in order.
+    // The text is only valid during the call.
+    template <typename Sink>
+    void execute(const char* line, size_t length, Sink& sink){
+      TRACE_ACTION(sequence() + 1);
+      const char* fields[MAX_FIELDS];
+      size_t lengths[MAX_FIELDS];
+#ifdef SIMPLE_CROSS_LATENCY
+      uint64_t start = monotonic_ns();
+#endif
+#ifdef SIMPLE_CROSS_ALLOCS
+      alloc_thread_state_t& allocs = alloc_state();
+      alloc_counts_t engine_before = allocs.engine, sink_before = allocs.sink;
+      allocs.guarded = strict && sequence() >= strict_from;
+      allocs.action = sequence() + 1;
+      alloc_sink_t<Sink> out(sink);
+#else
+      Sink& out = sink;
+#endif
+      size_t count;
+      {
+        PROBE_SPAN(PROBE_PARSE);
+        TRACE_SPAN("parse");
+        count = tokenize(line, length, fields, lengths);
+      }
+      action_kind_t kind = ACTION_REJECTED;
+      in_action() = 1;
+      if (count == 0 || lengths[ACTION] != 1){
+        error(out, "Malformed action input");
+      } else {
+        switch (fields[ACTION][0]){
+          case 'O':
+            kind = place_order(fields, lengths, count, out);
+            break;
+          case 'X':
+            kind = cancel_order(line, length, fields, lengths, count, out);
+            break;
+          case 'R':
+            kind = amend_order(fields, lengths, count, out);
+            break;
+          case 'P':
+            kind = print_query(fields, lengths, count, out);
+            break;
+          case 'Q':
+            kind = query_bbo(fields, lengths, count, out);
+            break;
+          case 'D':
+            kind = query_depth(fields, lengths, count, out);
+            break;
+          case 'S':
+            kind = stats_query(fields, lengths, count, out);
+            break;
+          default:
+            error(out, "Incorrect action character");
+        }
+      }
+      if (!deltas.empty()){
+        write_deltas(out);
+      }
+      in_action() = 0;
+      counters.actions[kind]++;
+#ifdef SIMPLE_CROSS_LATENCY
+      latencies[kind].record(monotonic_ns() - start);
+#endif
+#ifdef SIMPLE_CROSS_ALLOCS
+      allocs.guarded = false;
+      alloc_stats_t& stats = allocations[kind];
+      stats.actions++;
+      stats.engine.allocations += allocs.engine.allocations - engine_before.allocations;
+      stats.engine.bytes += allocs.engine.bytes - engine_before.bytes;
+      stats.sink.allocations += allocs.sink.allocations - sink_before.allocations;
+      stats.sink.bytes += allocs.sink.bytes - sink_before.bytes;
+#endif
+      sequence()++;
+      if (listener != NULL){
+        listener->action_done();
+      }
+    }
+
+#ifdef SIMPLE_CROSS_ALLOCS
+    // Aborts on any heap allocation made by the engine (its sink excluded)
+    // inside an action, once `warmup` more actions have run.
+    void strict_allocations(uint64_t warmup){
+      strict = true;
+      strict_from = sequence() + warmup;
+    }
+
+    // Allocations for each kind of action (see alloc_counter.h).
+    const alloc_stats_t& allocation(action_kind_t kind) const {
+      return allocations[kind];
+    }
+
+    // One line per kind of action seen.
+    std::string allocation_report() const {
+      std::string report;
+      for (int kind = 0; kind < ACTION_KINDS; kind++){
+        if (allocations[kind].actions > 0){
+          report += std::string("engine allocations ") + ACTION_KIND_NAMES[kind] + ": " + alloc_summary(allocations[kind]) + "\n";
+        }
+      }
+      return report;
+    }
+#endif
+
+#ifdef SIMPLE_CROSS_LATENCY
+    // Time spent in execute() for each kind of action, in ns (sink included).
+    const latency_histogram_t& latency(action_kind_t kind) const {
+      return latencies[kind];
+    }
+
+    // One line per kind of action seen, then all kinds merged.
+    std::string latency_report() const {
+      std::string report;
+      latency_histogram_t all;
+      for (int kind = 0; kind < ACTION_KINDS; kind++){
+        if (latencies[kind].count() > 0){
+          report += std::string("engine latency (ns) ") + ACTION_KIND_NAMES[kind] + ": " + latencies[kind].summary() + "\n";
+        }
+        all.merge(latencies[kind]);
+      }
+      return report + "engine latency (ns) all: " + all.summary() + "\n";
+    }
+#endif
+
+    // True while the order rests in the book: not yet filled, cancelled or
+    // killed.
+    bool is_resting(int32_t oid){
+      uint32_t* slot = OIDs.find(oid);
+      return slot != NULL && *slot != RETIRED_ORDER;
+    }
+
+    // Top of the symbol's book in O(1): the best level of each side is the
+    // back of its sorted vector and carries its running quantity and count.
+    // False if the symbol was never used.
+    bool bbo(const std::string& symbol, bbo_t& quote) const {
+      uint32_t book = find_book(symbol.data(), symbol.size());
+      if (book == NO_BOOK){
+        return false;
+      }
+      quote = top_of(books[book]);
+      return true;
+    }
+
+    // Copies up to `count` levels of one side of the symbol's book, best
+    // first, into levels; returns how many there were. O(count): every level
+    // keeps its running quantity and order count.
+    size_t depth(const std::string& symbol, char side, depth_level_t* levels, size_t count) const {
+      uint32_t book = find_book(symbol.data(), symbol.size());
+      if (book == NO_BOOK || (side != 'B' && side != 'S')){
+        return 0;
+      }
+      const side_book_t& sorted = side == 'B' ? books[book].bids : books[book].asks;
+      size_t n = std::min(count, sorted.size());
+      for (size_t i = 0; i < n; i++){
+        const level_t& level = sorted[sorted.size() - 1 - i];
+        levels[i] = depth_level_t{level.px, level.qty, level.count};
+      }
+      return n;
+    }
+
+    const engine_stats_t& stats() const {
+      return counters;
+    }
+
+    // Number of actions the book has seen, counted from its creation (or
+    // as set after restoring a checkpoint).
+    uint64_t& sequence(){
+      return pool.word(SEQUENCE_WORD);
+    }
+
+    // Keeps the order pool, the order id table and the symbol names in the
+    // files PREFIX.orders, PREFIX.ids and PREFIX.symbols, creating them if
+    // none exist, so the book survives the process; the level vectors and
+    // the symbol lookup are rebuilt from them. Must be called on an empty
+    // engine. Refuses files left by a process that died in the middle of an
+    // action.
+    bool map_book(const std::string& prefix, std::string& error){
+      bool created[3];
+      if (!pool.open(prefix + ".orders", created[0], error) || !OIDs.open(prefix + ".ids", created[1], error)
+          || !names.open(prefix + ".symbols", created[2], error)){
+        return false;
+      }
+      if (created[0] != created[1] || created[1] != created[2]){
+        error = "Book files " + prefix + ".* are incomplete";
+        return false;
+      }
+      if (in_action() != 0){
+        error = "Book files " + prefix + ".* were left in the middle of an action; remove them to rebuild the book from a checkpoint or the journal";
+        return false;
+      }
+      rebuild_index();
+      return true;
+    }
+
+    // Writes a mapped book back to disk.
+    bool sync_book(){
+      bool synced = pool.sync();
+      synced = OIDs.sync() && synced;
+      return names.sync() && synced;
+    }
+
+    vlist_t split(std::string line, char delimiter){
+      std::string temp_holder;
+      std::stringstream ss(line);
+      vlist_t string_array;
+      while (getline(ss, temp_holder, delimiter)){
+        string_array.push_back(temp_holder);
+      }
+      return string_array;
+    }
+
+    // Pre-sizes the order pool and id index so the hot path does not grow
+    // them.
+    void reserve(size_t orders){
+      pool.reserve(orders);
+      OIDs.reserve(orders);
+    }
+
+    // Creates the books of the given symbols up front with room for `levels`
+    // price levels per side, so that neither a symbol's first order nor a
+    // new price level allocates while a side holds no more than that.
+    void reserve_levels(const std::vector<std::string>& symbols, size_t levels){
+      books.reserve(books.size() + symbols.size());
+      books_by_name.reserve(books_by_name.size() + symbols.size());
+      for (const std::string& symbol : symbols){
+        symbol_book_t& book = books[book_for(symbol.data(), symbol.size())];
+        book.bids.reserve(levels);
+        book.asks.reserve(levels);
+      }
+    }
+
+    // Checkpoint support. Calls visit(oid, symbol, side, px, open_qty, live)
+    // for every resting order, by symbol, side, price level and priority,
+    // then for every retired order id (open_qty 0, empty symbol, side 0).
+    template <typename Visit>
+    void for_each_order(Visit visit){
+      for (uint32_t index : books_by_name){
+        const symbol_book_t& book = books[index];
+        const side_book_t* sides[2] = {&book.bids, &book.asks};
+        for (int side = 0; side < 2; side++){
+          for (const level_t& level : *sides[side]){
+            for (uint32_t i = level.head; i != NO_ORDER; i = pool[i].next){
+              visit(pool[i].oid, book.symbol, side == 0 ? 'B' : 'S', price(level.px), pool[i].qty, true);
+            }
+          }
+        }
+      }
+      const std::string none;
+      OIDs.for_each([&](int32_t oid, uint32_t value){
+        if (value == RETIRED_ORDER){
+          visit(oid, none, (char)0, 0.0, 0, false);
+        }
+      });
+    }
+
+    // Puts an order visited by for_each_order() back; resting orders must be
+    // restored in the order they were visited.
+    void restore_order(int order_id, const std::string& symbol, char side, double px, int open_qty, bool live){
+      uint32_t* slot = OIDs.insert(order_id);
+      if (!live || slot == NULL || (side != 'B' && side != 'S')){
+        return;
+      }
+      uint32_t book = book_for(symbol.data(), symbol.size());
+      int64_t units = std::llround(px * PX_SCALE);
+      side_book_t& levels = side == 'B' ? books[book].bids : books[book].asks;
+      level_t& level = levels.empty() || levels.back().px != units ? level_for(levels, side == 'B', units) : levels.back();
+      uint32_t index = new_order(order_id, open_qty, units, book, side);
+      link_after(level, level.tail, index);
+      *slot = index;
+    }
+
+    // Protocol text and level helpers; stateless, public so they can be
+    // measured on their own (micro_bench.cpp).
+    static const size_t MAX_FIELDS = 8;
+
+    // Splits on single spaces like getline() would: consecutive spaces give
+    // empty fields, one trailing space does not. Returns the field count;
+    // only the first MAX_FIELDS are stored.
+    static size_t tokenize(const char* line, size_t length, const char** fields, size_t* lengths){
+      size_t count = 0;
+      const char* end = line + length;
+      const char* p = line;
+      while (p < end){
+        const char* space = static_cast<const char*>(memchr(p, ' ', end - p));
+        const char* stop = space == NULL ? end : space;
+        if (count < MAX_FIELDS){
+          fields[count] = p;
+          lengths[count] = stop - p;
+        }
+        count++;
+        p = space == NULL ? end : space + 1;
+      }
+      return count;
+    }
+
+    // Unsigned decimal no larger than INT32_MAX.
+    static bool parse_int(const char* text, size_t length, int32_t& value){
+      if (length == 0 || length > 10){
+        return false;
+      }
+      int64_t number = 0;
+      for (size_t i = 0; i < length; i++){
+        if (text[i] < '0' || text[i] > '9'){
+          return false;
+        }
+        number = number * 10 + (text[i] - '0');
+      }
+      if (number > INT32_MAX){
+        return false;
+      }
+      value = (int32_t)number;
+      return true;
+    }
+
+    // Price in 1/PX_SCALE units. Plain decimals with up to 5 decimals are
+    // converted exactly; anything else strtod() accepts is rounded to 5
+    // decimals the way "%.5f" does.
+    static bool parse_price(const char* text, size_t length, int64_t& units){
+      if (parse_fixed_price(text, length, units)){
+        return true;
+      }
+      char buffer[64];
+      if (length == 0 || length >= sizeof(buffer)){
+        return false;
+      }
+      memcpy(buffer, text, length);
+      buffer[length] = '\0';
+      char* end;
+      double value = strtod(buffer, &end);
+      if (end != buffer + length || !std::isfinite(value) || std::fabs(value) >= 1e12){
+        return false;
+      }
+      int rounded = snprintf(buffer, sizeof(buffer), "%.5f", value);
+      return parse_fixed_price(buffer, rounded, units);
+    }
+
+    static bool parse_fixed_price(const char* text, size_t length, int64_t& units){
+      const char* p = text;
+      const char* end = text + length;
+      bool negative = p < end && *p == '-';
+      p += negative ? 1 : 0;
+      int64_t whole = 0, fraction = 0;
+      int digits = 0, decimals = 0;
+      for (; p < end && *p >= '0' && *p <= '9'; p++, digits++){
+        whole = whole * 10 + (*p - '0');
+      }
+      if (p < end && *p == '.'){
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, decimals++){
+          fraction = fraction * 10 + (*p - '0');
+        }
+      }
+      if (p != end || digits + decimals == 0 || digits > 12 || decimals > 5){
+        return false;
+      }
+      for (int i = decimals; i < 5; i++){
+        fraction *= 10;
+      }
+      units = whole * PX_SCALE + fraction;
+      units = negative ? -units : units;
+      return true;
+    }
+
+    static double price(int64_t units){
+      return (double)units / PX_SCALE;
+    }
+
+    static void put(char*& p, const char* text, size_t length){
+      memcpy(p, text, length);
+      p += length;
+    }
+
+    static void put_int(char*& p, int64_t value){
+      char digits[20];
+      int count = 0;
+      uint64_t magnitude = value < 0 ? -(uint64_t)value : value;
+      if (value < 0){
+        *p++ = '-';
+      }
+      do {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+      } while (magnitude != 0);
+      while (count > 0){
+        *p++ = digits[--count];
+      }
+    }
+
+    // "%.5f" of the price.
+    static void put_price(char*& p, int64_t units){
+      if (units < 0){
+        *p++ = '-';
+        units = -units;
+      }
+      put_int(p, units / PX_SCALE);
+      *p++ = '.';
+      int64_t fraction = units % PX_SCALE;
+      for (int64_t scale = PX_SCALE / 10; scale > 0; scale /= 10){
+        *p++ = '0' + fraction / scale % 10;
+      }
+    }
+
+    // Level at px, or where it would be inserted; bids are ascending, asks
+    // descending.
+    static side_book_t::iterator find_level(side_book_t& levels, bool ascending, int64_t px){
+      return ascending
+        ? std::lower_bound(levels.begin(), levels.end(), px, [](const level_t& level, int64_t p){ return level.px < p; })
+        : std::lower_bound(levels.begin(), levels.end(), px, [](const level_t& level, int64_t p){ return level.px > p; });
+    }
+
+private:
+    // Scalars kept in the order pool's header words.
+    static const int FREE_WORD = 0;
+    static const int SEQUENCE_WORD = 1;
+    static const int IN_ACTION_WORD = 2;
+
+    struct result_list_t {
+      result_list_t(results_t& results) : results(results) {}
+      void operator()(const char* text, size_t length){
+        results.emplace_back(text, length);
+      }
+      results_t& results;
+    };
+
+    template <typename Sink>
+    static void error(Sink& sink, const char* message){
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      char text[96];
+      char* p = text;
+      put(p, "E ", 2);
+      put(p, message, strlen(message));
+      sink(text, p - text);
+    }
+
+    template <typename Sink>
+    static void order_error(Sink& sink, int32_t oid, const char* message){
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      char text[96];
+      char* p = text;
+      put(p, "E ", 2);
+      put_int(p, oid);
+      *p++ = ' ';
+      put(p, message, strlen(message));
+      sink(text, p - text);
+    }
+
+    // "R OID QTY PX": an amend accepted.
+    template <typename Sink>
+    static void amended(Sink& sink, int32_t oid, int32_t qty, int64_t px){
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      char text[64];
+      char* p = text;
+      put(p, "R ", 2);
+      put_int(p, oid);
+      *p++ = ' ';
+      put_int(p, qty);
+      *p++ = ' ';
+      put_price(p, px);
+      sink(text, p - text);
+    }
+
+    // "X OID": a cancel, or the end of an IOC or FOK order's remainder.
+    template <typename Sink>
+    static void cancelled(Sink& sink, int32_t oid){
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      char text[16];
+      char* p = text;
+      put(p, "X ", 2);
+      put_int(p, oid);
+      sink(text, p - text);
+    }
+
+    template <typename Sink>
+    static void fill(Sink& sink, int32_t oid, const std::string& symbol, int32_t qty, int64_t px){
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      char text[96];
+      char* p = text;
+      put(p, "F ", 2);
+      put_int(p, oid);
+      *p++ = ' ';
+      put(p, symbol.data(), symbol.size());
+      *p++ = ' ';
+      put_int(p, qty);
+      *p++ = ' ';
+      put_price(p, px);
+      sink(text, p - text);
+    }
+
+    template <typename Sink>
+    action_kind_t place_order(const char** fields, const size_t* lengths, size_t count, Sink& sink){
+      int32_t oid, qty;
+      int64_t px;
+      time_in_force_t tif = TIF_DAY;
+      {
+        PROBE_SPAN(PROBE_VALIDATE);
+        if (count < 6 || count > TIF + 1){
+          error(sink, "Malformed order input");
+          return ACTION_REJECTED;
+        }
+        if (lengths[SYMBOL] > 8){
+          error(sink, "symbol input too long");
+          return ACTION_REJECTED;
+        }
+        if (lengths[SYMBOL] == 0){
+          error(sink, "Malformed symbol input");
+          return ACTION_REJECTED;
+        }
+        if (lengths[SIDE] != 1){
+          error(sink, "Malformed side input");
+          return ACTION_REJECTED;
+        }
+      }
+      {
+        PROBE_SPAN(PROBE_PARSE);
+        TRACE_SPAN("parse");
+        if (!parse_int(fields[OID], lengths[OID], oid)){
+          error(sink, "Malformed order id");
+          return ACTION_REJECTED;
+        }
+        if (!parse_int(fields[QTY], lengths[QTY], qty) || qty == 0){
+          order_error(sink, oid, "Malformed quantity input");
+          return ACTION_REJECTED;
+        }
+        if (!parse_price(fields[PX], lengths[PX], px)){
+          order_error(sink, oid, "Malformed price input");
+          return ACTION_REJECTED;
+        }
+        if (count > TIF && !parse_tif(fields[TIF], lengths[TIF], tif)){
+          order_error(sink, oid, "Malformed time in force input");
+          return ACTION_REJECTED;
+        }
+      }
+      uint32_t* slot;
+      char side = fields[SIDE][0];
+      {
+        PROBE_SPAN(PROBE_VALIDATE);
+        slot = OIDs.insert(oid);
+        if (slot == NULL){
+          order_error(sink, oid, "Duplicate order id");
+          return ACTION_REJECTED;
+        }
+        if (side != 'B' && side != 'S'){
+          error(sink, "Incorrect side character");
+          return ACTION_REJECTED;
+        }
+      }
+      uint32_t book;
+      {
+        PROBE_SPAN(PROBE_SYMBOL);
+        book = book_for(fields[SYMBOL], lengths[SYMBOL]);
+      }
+      if (tif == TIF_FOK && !fillable(books[book], side, qty, px)){
+        cancelled(sink, oid);
+        return ACTION_KILLED;
+      }
+      int32_t open_qty = cross(oid, book, side, qty, px, sink);
+      action_kind_t kind = open_qty < qty ? ACTION_CROSSING : ACTION_PASSIVE;
+      if (open_qty > 0 && tif != TIF_DAY){
+        cancelled(sink, oid);
+        return open_qty < qty ? ACTION_CROSSING : ACTION_KILLED;
+      } else if (open_qty > 0){
+        rest(oid, book, side, open_qty, px, slot);
+      }
+      return kind;
+    }
+
+    // Puts an order that did not fill completely into the book, at the back
+    // of its level's queue: priority is price, then arrival, whatever the
+    // order ids (the old map<int, ...> books ranked a level by id).
+    void rest(int32_t oid, uint32_t book, char side, int32_t qty, int64_t px, uint32_t* slot){
+      PROBE_SPAN(PROBE_INSERT);
+      TRACE_SPAN("insert");
+      side_book_t& levels = side == 'B' ? books[book].bids : books[book].asks;
+      level_t& level = level_for(levels, side == 'B', px);
+      uint32_t index = new_order(oid, qty, px, book, side);
+      link_after(level, level.tail, index);
+      *slot = index;
+      if (delta_mode != DELTAS_NONE){
+        book_delta('A', pool[index], level);
+      }
+      if (listener != NULL){
+        listener->order_added(books[book].symbol, side, oid, price(px), qty);
+      }
+    }
+
+    // R OID QTY PX. A smaller quantity at the same price is applied in place
+    // and keeps the order's place in its queue; any other change takes the
+    // order out and sends it through crossing again with the new quantity
+    // and price, resting what is left at the back of its level. The "R OID
+    // QTY PX" confirmation comes before any fills.
+    template <typename Sink>
+    action_kind_t amend_order(const char** fields, const size_t* lengths, size_t count, Sink& sink){
+      const int AMEND_QTY = 2, AMEND_PX = 3;
+      int32_t oid, qty;
+      int64_t px;
+      {
+        PROBE_SPAN(PROBE_PARSE);
+        TRACE_SPAN("parse");
+        if (count != 4){
+          error(sink, "Malformed amend input");
+          return ACTION_REJECTED;
+        }
+        if (!parse_int(fields[OID], lengths[OID], oid)){
+          error(sink, "Malformed order id");
+          return ACTION_REJECTED;
+        }
+        if (!parse_int(fields[AMEND_QTY], lengths[AMEND_QTY], qty) || qty == 0){
+          order_error(sink, oid, "Malformed quantity input");
+          return ACTION_REJECTED;
+        }
+        if (!parse_price(fields[AMEND_PX], lengths[AMEND_PX], px)){
+          order_error(sink, oid, "Malformed price input");
+          return ACTION_REJECTED;
+        }
+      }
+      uint32_t* slot;
+      {
+        PROBE_SPAN(PROBE_VALIDATE);
+        slot = OIDs.find(oid);
+        if (slot == NULL){
+          order_error(sink, oid, "Unknown order id");
+          return ACTION_REJECTED;
+        }
+        if (*slot == RETIRED_ORDER){
+          order_error(sink, oid, "Order is not resting");
+          return ACTION_REJECTED;
+        }
+      }
+      amended(sink, oid, qty, px);
+      uint32_t index = *slot;
+      order_t& order = pool[index];
+      side_book_t& levels = order.side == 'B' ? books[order.book].bids : books[order.book].asks;
+      side_book_t::iterator level = find_level(levels, order.side == 'B', order.px);
+      if (px == order.px && qty <= order.qty){
+        int32_t old_qty = order.qty;
+        level->qty -= old_qty - qty;
+        side_qty(order) -= old_qty - qty;
+        order.qty = qty;
+        if (qty != old_qty && listener != NULL){
+          listener->order_modified(books[order.book].symbol, order.side, oid, price(px), old_qty, qty);
+        }
+        if (qty != old_qty && delta_mode != DELTAS_NONE){
+          book_delta('M', order, *level);
+        }
+        return ACTION_AMEND;
+      }
+      uint32_t book = order.book;
+      char side = order.side;
+      {
+        PROBE_SPAN(PROBE_REMOVE);
+        TRACE_SPAN("remove");
+        *slot = RETIRED_ORDER;
+        unlink(*level, index);
+        if (level->head == NO_ORDER){
+          levels.erase(level);
+        }
+      }
+      int32_t open_qty = cross(oid, book, side, qty, px, sink);
+      if (open_qty > 0){
+        rest(oid, book, side, open_qty, px, slot);
+      }
+      return ACTION_AMEND;
+    }
+
+    // Whether an order for qty at limit px would fill completely against the
+    // opposite side, without visiting orders or changing anything. The side's
+    // running total answers at once when it is too small, or when even the
+    // worst level is within the limit; otherwise the running quantities of
+    // the crossing levels are summed, best first.
+    bool fillable(const symbol_book_t& book, char side, int64_t qty, int64_t px) const {
+      const side_book_t& opposite = side == 'B' ? book.asks : book.bids;
+      int64_t total = side == 'B' ? book.ask_qty : book.bid_qty;
+      if (total < qty){
+        return false;
+      }
+      if (side == 'B' ? opposite.front().px <= px : opposite.front().px >= px){
+        return true;
+      }
+      for (size_t i = opposite.size(); i > 0 && qty > 0; i--){
+        const level_t& level = opposite[i - 1];
+        if (side == 'B' ? level.px > px : level.px < px){
+          break;
+        }
+        qty -= level.qty;
+      }
+      return qty <= 0;
+    }
+
+    static bool parse_tif(const char* text, size_t length, time_in_force_t& tif){
+      if (length != 3){
+        return false;
+      }
+      if (memcmp(text, "DAY", 3) == 0){
+        tif = TIF_DAY;
+      } else if (memcmp(text, "IOC", 3) == 0){
+        tif = TIF_IOC;
+      } else if (memcmp(text, "FOK", 3) == 0){
+        tif = TIF_FOK;
+      } else {
+        return false;
+      }
+      return true;
+    }
+
+    // Trades an incoming order against the opposite side, best level first
+    // and by arrival (time priority) within a level; an order amended to a
+    // new price or more quantity counts as arriving again. Returns the
+    // quantity left open.
+    //
+    // Two reporting rules are kept from the original engine so recorded
+    // sessions still replay: the fill that completes the incoming order
+    // reports the incoming order's entered quantity on both lines, and an
+    // incoming sell reports its own limit price as the fill price.
+    template <typename Sink>
+    int32_t cross(int32_t oid, uint32_t book, char side, int32_t qty, int64_t px, Sink& sink){
+      PROBE_SPAN(PROBE_LEVEL_WALK);
+      TRACE_SPAN("match");
+      symbol_book_t& symbol_book = books[book];
+      side_book_t& opposite = side == 'B' ? symbol_book.asks : symbol_book.bids;
+      int32_t remaining = qty;
+      while (remaining > 0 && !opposite.empty() && (side == 'B' ? opposite.back().px <= px : opposite.back().px >= px)){
+        level_t& level = opposite.back();
+        int64_t fill_px = side == 'B' ? level.px : px;
+        while (remaining > 0 && level.head != NO_ORDER){
+          uint32_t index = level.head;
+          order_t& resting = pool[index];
+          int32_t traded = std::min(resting.qty, remaining);
+          TRACE_INSTANT("fill", "oid", resting.oid, "qty", traded);
+          if (listener != NULL){
+            listener->trade(symbol_book.symbol, price(level.px), traded);
+          }
+          counters.trades++;
+          counters.traded_qty += traded;
+          int32_t reported = resting.qty >= remaining ? qty : resting.qty;
+          fill(sink, oid, symbol_book.symbol, reported, fill_px);
+          fill(sink, resting.oid, symbol_book.symbol, reported, fill_px);
+          PROBE_SPAN(PROBE_FILL);
+          if (resting.qty > remaining){
+            int32_t old_qty = resting.qty;
+            resting.qty -= remaining;
+            level.qty -= remaining;
+            side_qty(resting) -= remaining;
+            remaining = 0;
+            if (listener != NULL){
+              listener->order_modified(symbol_book.symbol, resting.side, resting.oid, price(level.px), old_qty, resting.qty);
+            }
+            if (delta_mode != DELTAS_NONE){
+              book_delta('M', resting, level);
+            }
+          } else {
+            remaining -= resting.qty;
+            *OIDs.find(resting.oid) = RETIRED_ORDER;
+            unlink(level, index);
+          }
+        }
+        if (level.head == NO_ORDER){
+          opposite.pop_back();
+        }
+      }
+      return remaining;
+    }
+
+    template <typename Sink>
+    action_kind_t cancel_order(const char* line, size_t length, const char** fields, const size_t* lengths, size_t count, Sink& sink){
+      int32_t oid;
+      uint32_t* slot;
+      {
+        PROBE_SPAN(PROBE_PARSE);
+        TRACE_SPAN("parse");
+        if (count < 2){
+          error(sink, "Malformed cancel input");
+          return ACTION_REJECTED;
+        }
+        if (!parse_int(fields[OID], lengths[OID], oid)){
+          error(sink, "Malformed order id");
+          return ACTION_REJECTED;
+        }
+      }
+      {
+        PROBE_SPAN(PROBE_VALIDATE);
+        slot = OIDs.find(oid);
+        if (slot == NULL){
+          order_error(sink, oid, "Unknown order id");
+          return ACTION_REJECTED;
+        }
+      }
+      if (*slot != RETIRED_ORDER){
+        PROBE_SPAN(PROBE_REMOVE);
+        TRACE_SPAN("remove");
+        uint32_t index = *slot;
+        *slot = RETIRED_ORDER;
+        const order_t& order = pool[index];
+        side_book_t& levels = order.side == 'B' ? books[order.book].bids : books[order.book].asks;
+        side_book_t::iterator level = find_level(levels, order.side == 'B', order.px);
+        unlink(*level, index);
+        if (level->head == NO_ORDER){
+          levels.erase(level);
+        }
+      }
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      sink(line, length);
+      return ACTION_CANCEL;
+    }
+
+    template <typename Sink>
+    action_kind_t print_query(const char** fields, const size_t* lengths, size_t count, Sink& sink){
+      if (count == 1){
+        print_book(sink);
+      } else if (count == 2 && lengths[1] > 0 && lengths[1] <= 8){
+        uint32_t book = find_book(fields[1], lengths[1]);
+        if (book != NO_BOOK){
+          print_symbol(sink, books[book]);
+        }
+      } else {
+        error(sink, "Malformed print input");
+        return ACTION_REJECTED;
+      }
+      return ACTION_PRINT;
+    }
+
+    // Every symbol in name order.
+    template <typename Sink>
+    void print_book(Sink& sink){
+      for (uint32_t index : books_by_name){
+        print_symbol(sink, books[index]);
+      }
+    }
+
+    // One symbol by descending price (sells first at an equal price) and
+    // latest arrival first within a level, streamed to the sink line by line
+    // straight from the levels.
+    template <typename Sink>
+    void print_symbol(Sink& sink, const symbol_book_t& book){
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      char text[96];
+      size_t ask = 0, bid = book.bids.size();
+      while (ask < book.asks.size() || bid > 0){
+        bool sell = bid == 0 || (ask < book.asks.size() && book.asks[ask].px >= book.bids[bid - 1].px);
+        const level_t& level = sell ? book.asks[ask++] : book.bids[--bid];
+        for (uint32_t i = level.tail; i != NO_ORDER; i = pool[i].prev){
+          char* p = text;
+          put(p, "P ", 2);
+          put_int(p, pool[i].oid);
+          *p++ = ' ';
+          put(p, book.symbol.data(), book.symbol.size());
+          *p++ = ' ';
+          *p++ = sell ? 'S' : 'B';
+          *p++ = ' ';
+          put_int(p, pool[i].qty);
+          *p++ = ' ';
+          put_price(p, level.px);
+          sink(text, p - text);
+        }
+      }
+    }
+
+    template <typename Sink>
+    action_kind_t query_bbo(const char** fields, const size_t* lengths, size_t count, Sink& sink){
+      if (count != 2 || lengths[1] == 0 || lengths[1] > 8){
+        error(sink, "Malformed quote input");
+        return ACTION_REJECTED;
+      }
+      const char* symbol = fields[1];
+      size_t length = lengths[1];
+      uint32_t book = find_book(symbol, length);
+      bbo_t top = book == NO_BOOK ? bbo_t() : top_of(books[book]);
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      char text[96];
+      char* p = text;
+      put(p, "Q ", 2);
+      put(p, symbol, length);
+      *p++ = ' ';
+      put_int(p, top.bid_qty);
+      *p++ = ' ';
+      put_price(p, top.bid_px);
+      *p++ = ' ';
+      put_int(p, top.ask_qty);
+      *p++ = ' ';
+      put_price(p, top.ask_px);
+      sink(text, p - text);
+      return ACTION_QUERY;
+    }
+
+    template <typename Sink>
+    action_kind_t query_depth(const char** fields, const size_t* lengths, size_t count, Sink& sink){
+      int32_t levels;
+      if (count != 3 || lengths[1] == 0 || lengths[1] > 8 || !parse_int(fields[2], lengths[2], levels) || levels == 0){
+        error(sink, "Malformed depth input");
+        return ACTION_REJECTED;
+      }
+      uint32_t book = find_book(fields[1], lengths[1]);
+      if (book == NO_BOOK){
+        return ACTION_QUERY;
+      }
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      const symbol_book_t& symbol_book = books[book];
+      char text[96];
+      for (int side = 0; side < 2; side++){
+        const side_book_t& sorted = side == 0 ? symbol_book.bids : symbol_book.asks;
+        size_t n = std::min((size_t)levels, sorted.size());
+        for (size_t i = 0; i < n; i++){
+          const level_t& level = sorted[sorted.size() - 1 - i];
+          char* p = text;
+          put(p, "D ", 2);
+          put(p, symbol_book.symbol.data(), symbol_book.symbol.size());
+          *p++ = ' ';
+          *p++ = side == 0 ? 'B' : 'S';
+          *p++ = ' ';
+          put_int(p, level.qty);
+          *p++ = ' ';
+          put_price(p, level.px);
+          *p++ = ' ';
+          put_int(p, level.count);
+          sink(text, p - text);
+        }
+      }
+      return ACTION_QUERY;
+    }
+
+    static bbo_t top_of(const symbol_book_t& book){
+      bbo_t top = bbo_t();
+      if (!book.bids.empty()){
+        top.bid_px = book.bids.back().px;
+        top.bid_qty = book.bids.back().qty;
+        top.bid_orders = book.bids.back().count;
+      }
+      if (!book.asks.empty()){
+        top.ask_px = book.asks.back().px;
+        top.ask_qty = book.asks.back().qty;
+        top.ask_orders = book.asks.back().count;
+      }
+      return top;
+    }
+
+    template <typename Sink>
+    action_kind_t stats_query(const char** fields, const size_t* lengths, size_t count, Sink& sink){
+      if (count == 1){
+        print_stats(sink);
+      } else if (count == 2 && lengths[1] == 5 && memcmp(fields[1], "shape", 5) == 0){
+        print_shape(sink);
+      } else {
+        error(sink, "Malformed stats input");
+        return ACTION_REJECTED;
+      }
+      return ACTION_STATS;
+    }
+
+    // "S shape" lines, one per symbol (in name order) and side, from the
+    // level vectors alone, without visiting orders:
+    //     S shape SYMBOL SIDE orders N levels N spare_levels N bytes N deepest N at PX span PX min_gap PX fill F
+    // spare_levels is the unused capacity of the level vector (levels are
+    // removed as soon as they empty, so there are never empty ones); bytes
+    // counts the level vector's capacity and the side's pool entries. span
+    // is the distance from the best to the worst level, min_gap the closest
+    // two levels, and fill the share of the min_gap ladder over the span
+    // that holds a level: near 1 a dense price ladder would fit the side, a
+    // low value says the levels are sparse.
+    template <typename Sink>
+    void print_shape(Sink& sink){
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      char text[256];
+      for (uint32_t index : books_by_name){
+        const symbol_book_t& book = books[index];
+        for (int side = 0; side < 2; side++){
+          const side_book_t& levels = side == 0 ? book.bids : book.asks;
+          uint32_t orders = side == 0 ? book.bid_orders : book.ask_orders;
+          const level_t* deepest = NULL;
+          int64_t min_gap = 0;
+          for (size_t i = 0; i < levels.size(); i++){
+            deepest = deepest == NULL || levels[i].count > deepest->count ? &levels[i] : deepest;
+            int64_t gap = i > 0 ? std::abs(levels[i].px - levels[i - 1].px) : 0;
+            min_gap = i == 1 || (i > 1 && gap < min_gap) ? gap : min_gap;
+          }
+          int64_t span = levels.empty() ? 0 : std::abs(levels.back().px - levels.front().px);
+          double fill = levels.empty() ? 0.0 : min_gap == 0 ? 1.0 : (double)levels.size() / (span / min_gap + 1);
+          char* p = text;
+          p += snprintf(p, 128, "S shape %s %c orders %u levels %zu spare_levels %zu bytes %zu deepest %u at ",
+                        book.symbol.c_str(), side == 0 ? 'B' : 'S', orders, levels.size(), levels.capacity() - levels.size(),
+                        levels.capacity() * sizeof(level_t) + orders * sizeof(order_t), deepest == NULL ? 0 : deepest->count);
+          put_price(p, deepest == NULL ? 0 : deepest->px);
+          put(p, " span ", 6);
+          put_price(p, span);
+          put(p, " min_gap ", 9);
+          put_price(p, min_gap);
+          p += snprintf(p, 32, " fill %.3f", fill);
+          sink(text, p - text);
+        }
+      }
+    }
+
+    // S result lines, all from counters kept as the book changes:
+    //     S counters accepted N rested N crossed N killed N trades N volume N cancels N errors N prints N stats N
+    //     S pool resting N entries N capacity N ids N id_slots N
+    //     S book SYMBOL SIDE orders N levels N qty N   (per symbol in name order, B then S)
+    //     S latency count=N p50=N p99=N p99.9=N max=N   (ns, with SIMPLE_CROSS_LATENCY)
+    template <typename Sink>
+    void print_stats(Sink& sink){
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      char text[256];
+      const uint64_t* actions = counters.actions;
+      int length = snprintf(text, sizeof(text), "S counters accepted %llu rested %llu crossed %llu killed %llu trades %llu "
+                            "volume %llu cancels %llu errors %llu prints %llu stats %llu",
+                            (unsigned long long)(actions[ACTION_PASSIVE] + actions[ACTION_CROSSING] + actions[ACTION_KILLED]),
+                            (unsigned long long)actions[ACTION_PASSIVE], (unsigned long long)actions[ACTION_CROSSING],
+                            (unsigned long long)actions[ACTION_KILLED],
+                            (unsigned long long)counters.trades, (unsigned long long)counters.traded_qty,
+                            (unsigned long long)actions[ACTION_CANCEL], (unsigned long long)actions[ACTION_REJECTED],
+                            (unsigned long long)actions[ACTION_PRINT], (unsigned long long)actions[ACTION_STATS]);
+      sink(text, length);
+      length = snprintf(text, sizeof(text), "S pool resting %llu entries %zu capacity %zu ids %zu id_slots %zu",
+                        (unsigned long long)counters.resting, pool.size(), pool.capacity(), OIDs.count(), OIDs.capacity());
+      sink(text, length);
+      for (uint32_t index : books_by_name){
+        const symbol_book_t& book = books[index];
+        length = snprintf(text, sizeof(text), "S book %s B orders %u levels %zu qty %lld", book.symbol.c_str(), book.bid_orders,
+                          book.bids.size(), (long long)book.bid_qty);
+        sink(text, length);
+        length = snprintf(text, sizeof(text), "S book %s S orders %u levels %zu qty %lld", book.symbol.c_str(), book.ask_orders,
+                          book.asks.size(), (long long)book.ask_qty);
+        sink(text, length);
+      }
+#ifdef SIMPLE_CROSS_LATENCY
+      latency_histogram_t all;
+      for (int kind = 0; kind < ACTION_KINDS; kind++){
+        all.merge(latencies[kind]);
+      }
+      length = snprintf(text, sizeof(text), "S latency %s", all.summary().c_str());
+      sink(text, length);
+#endif
+    }
+
+    // Index of the symbol's book, or NO_BOOK if it was never used.
+    uint32_t find_book(const char* symbol, size_t length) const {
+      uint64_t key = 0;
+      memcpy(&key, symbol, std::min(length, sizeof(key)));
+      std::unordered_map<uint64_t, uint32_t>::const_iterator found = symbol_index.find(key);
+      return length > sizeof(key) || found == symbol_index.end() ? NO_BOOK : found->second;
+    }
+
+    // Index of the symbol's book, created on first use.
+    uint32_t book_for(const char* symbol, size_t length){
+      uint32_t found = find_book(symbol, length);
+      if (found != NO_BOOK){
+        return found;
+      }
+      symbol_name_t name;
+      memset(&name, 0, sizeof(name));
+      memcpy(name.text, symbol, std::min(length, sizeof(name.text)));
+      names.push_back(name);
+      return add_book(names.size() - 1);
+    }
+
+    // Creates the in-memory book for names[index].
+    uint32_t add_book(uint32_t index){
+      const symbol_name_t& name = names[index];
+      uint64_t key = 0;
+      memcpy(&key, name.text, sizeof(key));
+      books.push_back(symbol_book_t());
+      books.back().symbol.assign(name.text, strnlen(name.text, sizeof(name.text)));
+      symbol_index[key] = index;
+      std::vector<uint32_t>::iterator position = std::lower_bound(books_by_name.begin(), books_by_name.end(), index,
+        [this](uint32_t a, uint32_t b){ return books[a].symbol < books[b].symbol; });
+      books_by_name.insert(position, index);
+      return index;
+    }
+
+    // Recreates books and their level vectors from a mapped pool: every
+    // live order without a predecessor heads a level.
+    void rebuild_index(){
+      books.clear();
+      symbol_index.clear();
+      books_by_name.clear();
+      counters.resting = 0;
+      for (uint32_t i = 0; i < names.size(); i++){
+        add_book(i);
+      }
+      for (uint32_t i = 0; i < pool.size(); i++){
+        const order_t& head = pool[i];
+        if (head.side == 0 || head.prev != NO_ORDER){
+          continue;
+        }
+        level_t level = {head.px, 0, 0, i, NO_ORDER};
+        for (uint32_t j = i; j != NO_ORDER; j = pool[j].next){
+          level.tail = j;
+          level.qty += pool[j].qty;
+          level.count++;
+        }
+        (head.side == 'B' ? books[head.book].bid_orders : books[head.book].ask_orders) += level.count;
+        side_qty(head) += level.qty;
+        counters.resting += level.count;
+        (head.side == 'B' ? books[head.book].bids : books[head.book].asks).push_back(level);
+      }
+      for (symbol_book_t& book : books){
+        std::sort(book.bids.begin(), book.bids.end(), [](const level_t& a, const level_t& b){ return a.px < b.px; });
+        std::sort(book.asks.begin(), book.asks.end(), [](const level_t& a, const level_t& b){ return a.px > b.px; });
+      }
+    }
+
+    uint64_t& free_orders(){
+      return pool.word(FREE_WORD);
+    }
+
+    uint64_t& in_action(){
+      return pool.word(IN_ACTION_WORD);
+    }
+
+    // The level at px, inserted empty if there is none.
+    static level_t& level_for(side_book_t& levels, bool ascending, int64_t px){
+      side_book_t::iterator level = find_level(levels, ascending, px);
+      if (level == levels.end() || level->px != px){
+        level = levels.insert(level, level_t{px, 0, 0, NO_ORDER, NO_ORDER});
+      }
+      return *level;
+    }
+
+    uint32_t new_order(int32_t oid, int32_t qty, int64_t px, uint32_t book, char side){
+      uint32_t index = free_orders();
+      if (index == NO_ORDER){
+        index = pool.size();
+        pool.push_back(order_t());
+      } else {
+        free_orders() = pool[index].next;
+      }
+      order_t& order = pool[index];
+      order.px = px;
+      order.oid = oid;
+      order.qty = qty;
+      order.prev = NO_ORDER;
+      order.next = NO_ORDER;
+      order.book = book;
+      order.side = side;
+      (side == 'B' ? books[book].bid_orders : books[book].ask_orders)++;
+      counters.resting++;
+      return index;
+    }
+
+    // Links order `index` into the level after `after` (NO_ORDER: at the head).
+    void link_after(level_t& level, uint32_t after, uint32_t index){
+      order_t& order = pool[index];
+      order.prev = after;
+      order.next = after == NO_ORDER ? level.head : pool[after].next;
+      (order.next == NO_ORDER ? level.tail : pool[order.next].prev) = index;
+      (after == NO_ORDER ? level.head : pool[after].next) = index;
+      level.qty += order.qty;
+      side_qty(order) += order.qty;
+      level.count++;
+    }
+
+    // One book change; event is A (added), M (modified) or R (removed) for
+    // the order, after the change has been applied to it and its level.
+    struct delta_t {
+      char event;
+      char side;
+      uint32_t book;
+      int32_t oid;
+      int64_t px;
+      int64_t qty;
+      uint32_t count;
+    };
+
+    void book_delta(char event, const order_t& order, const level_t& level){
+      if (delta_mode == DELTAS_ORDER){
+        deltas.push_back(delta_t{event, order.side, order.book, order.oid, order.px, event == 'R' ? 0 : order.qty, 0});
+        return;
+      }
+      char change = level.count == 0 ? 'D' : event == 'A' && level.count == 1 ? 'A' : 'U';
+      if (!deltas.empty() && deltas.back().book == order.book && deltas.back().side == order.side && deltas.back().px == level.px){
+        delta_t& last = deltas.back();
+        if (last.event == 'A' && change == 'D'){
+          deltas.pop_back();
+          return;
+        }
+        last.event = last.event == 'A' ? 'A' : last.event == 'D' && change == 'A' ? 'U' : change;
+        last.qty = level.qty;
+        last.count = level.count;
+        return;
+      }
+      deltas.push_back(delta_t{change, order.side, order.book, 0, level.px, level.qty, level.count});
+    }
+
+    template <typename Sink>
+    void write_deltas(Sink& sink){
+      PROBE_SPAN(PROBE_OUTPUT);
+      TRACE_SPAN("output");
+      char text[96];
+      for (const delta_t& delta : deltas){
+        const std::string& symbol = books[delta.book].symbol;
+        char* p = text;
+        *p++ = delta_mode == DELTAS_ORDER ? 'B' : 'L';
+        *p++ = ' ';
+        *p++ = delta.event;
+        *p++ = ' ';
+        if (delta_mode == DELTAS_ORDER){
+          put_int(p, delta.oid);
+          *p++ = ' ';
+        }
+        put(p, symbol.data(), symbol.size());
+        *p++ = ' ';
+        *p++ = delta.side;
+        *p++ = ' ';
+        put_int(p, delta.qty);
+        *p++ = ' ';
+        put_price(p, delta.px);
+        if (delta_mode == DELTAS_LEVEL){
+          *p++ = ' ';
+          put_int(p, delta.count);
+        }
+        sink(text, p - text);
+      }
+      deltas.clear();
+    }
+
+    // Running open quantity of the side the order rests on.
+    int64_t& side_qty(const order_t& order){
+      return order.side == 'B' ? books[order.book].bid_qty : books[order.book].ask_qty;
+    }
+
+    // Takes order `index` out of its level, reports it and frees its entry.
+    void unlink(level_t& level, uint32_t index){
+      order_t& order = pool[index];
+      (order.prev == NO_ORDER ? level.head : pool[order.prev].next) = order.next;
+      (order.next == NO_ORDER ? level.tail : pool[order.next].prev) = order.prev;
+      level.qty -= order.qty;
+      side_qty(order) -= order.qty;
+      level.count--;
+      if (listener != NULL){
+        listener->order_removed(books[order.book].symbol, order.side, order.oid, price(order.px), order.qty);
+      }
+      if (delta_mode != DELTAS_NONE){
+        book_delta('R', order, level);
+      }
+      (order.side == 'B' ? books[order.book].bid_orders : books[order.book].ask_orders)--;
+      counters.resting--;
+      order.side = 0;
+      order.next = free_orders();
+      free_orders() = index;
+    }
+
+    book_listener_t* listener;
+    action_log_t* action_log;
+    mapped_array_t<order_t> pool;
+    mapped_array_t<symbol_name_t> names;
+    std::vector<symbol_book_t> books;
+    std::unordered_map<uint64_t, uint32_t> symbol_index;
+    std::vector<uint32_t> books_by_name;
+    oid_index_t OIDs;
+    engine_stats_t counters;
+    book_deltas_t delta_mode;
+    std::vector<delta_t> deltas;        // changes of the current action
+#ifdef SIMPLE_CROSS_LATENCY
+    latency_histogram_t latencies[ACTION_KINDS];
+#endif
+#ifdef SIMPLE_CROSS_ALLOCS
+    alloc_stats_t allocations[ACTION_KINDS] = {};
+    bool strict = false;
+    uint64_t strict_from = 0;   // sequence() before the first guarded action
+#endif
+};
+
+#endif
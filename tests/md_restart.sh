@@ -0,0 +1,21 @@
+#!/bin/sh
+# Restarts from a book file holding two orders at one level and cancels one
+# of them: the feed must publish the level with one order left, and the book
+# md_listener rebuilds (snapshot plus feed) must match the engine's.
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+feed=239.1.1.1:15100
+cat > "$dir/before.txt" <<ACTIONS
+O 10001 IBM B 10 100.00000
+O 10002 IBM B 5 100.00000
+O 10003 IBM S 7 101.00000
+ACTIONS
+echo "X 10001" > "$dir/after.txt"
+cat "$dir/before.txt" "$dir/after.txt" > "$dir/all.txt"
+./simple_cross --input "$dir/before.txt" --book-file "$dir/book" > /dev/null
+./md_listener $feed --check "$dir/all.txt" > "$dir/listener.txt" &
+listener=$!
+(sleep 1; cat "$dir/after.txt") | ./simple_cross --input - --book-file "$dir/book" --md-multicast $feed > /dev/null
+wait $listener
+grep -q "rebuilt book matches the engine" "$dir/listener.txt"
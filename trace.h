@@ -0,0 +1,267 @@
+/*
+Sampled action tracing in the Chrome trace event format, which Perfetto and
+chrome://tracing load as a timeline.
+
+With -DSIMPLE_CROSS_TRACE ("make TRACE=1") the engine marks the lifecycle of
+an action: TRACE_ACTION opens the action's span and an instant "receive"
+event at the moment execute() is entered, TRACE_SPAN(name) covers a stage
+(parse, match, insert, remove, output) until the end of the enclosing block
+and TRACE_INSTANT(name, ...) marks a point such as a fill. Only every Nth
+action is recorded; in the others TRACE_SPAN costs a thread-local load and
+a branch. Without the flag the macros expand to nothing.
+
+Each thread writes its events into its own single-producer ring of fixed
+size, with no locks and no allocation after the thread's first event; a
+full ring drops events and counts them. A background thread drains every
+ring every few milliseconds and appends the events to the JSON file, so the
+recording threads never touch the file. trace_stop() drains what is left
+and closes the JSON array.
+*/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <time.h>
+
+const int TRACE_MAX_THREADS = 64;
+const size_t TRACE_RING_EVENTS = 1 << 16;     // per thread, a power of two
+
+struct trace_event_t {
+  const char* name;     // string literal
+  char phase;           // 'X' complete span, 'i' instant
+  uint64_t ts;          // ns on CLOCK_MONOTONIC
+  uint64_t dur;         // ns, for 'X'
+  const char* keys[2];  // argument names (string literals) or NULL
+  int64_t args[2];
+};
+
+// Written by one thread, drained by the flusher.
+struct trace_ring_t {
+  std::atomic<uint64_t> head{0};    // next event to write
+  std::atomic<uint64_t> tail{0};    // next event to drain
+  std::atomic<uint64_t> dropped{0};
+  int tid = 0;
+  trace_event_t events[TRACE_RING_EVENTS];
+};
+
+struct trace_session_t {
+  std::atomic<bool> on{false};
+  uint64_t sample_every = 1;
+  std::atomic<uint64_t> actions{0};
+  std::atomic<int> threads{0};
+  std::atomic<trace_ring_t*> rings[TRACE_MAX_THREADS];   // NULL until registered
+  FILE* file = NULL;
+  bool first = true;
+  uint64_t written = 0;
+  std::thread flusher;
+  std::mutex lock;
+  std::condition_variable wake;
+  bool stopping = false;
+};
+
+inline trace_session_t& trace_session(){
+  static trace_session_t session;
+  return session;
+}
+
+inline uint64_t trace_clock(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// True while the current thread is inside a sampled action.
+inline bool& trace_sampled(){
+  static thread_local bool sampled = false;
+  return sampled;
+}
+
+// The calling thread's ring, registered on first use; NULL once
+// TRACE_MAX_THREADS threads have one.
+inline trace_ring_t* trace_thread_ring(){
+  static thread_local trace_ring_t* ring = NULL;
+  static thread_local bool registered = false;
+  if (!registered){
+    registered = true;
+    trace_session_t& session = trace_session();
+    int slot = session.threads.fetch_add(1);
+    if (slot < TRACE_MAX_THREADS){
+      ring = new trace_ring_t();
+      ring->tid = slot + 1;
+      session.rings[slot].store(ring, std::memory_order_release);
+    }
+  }
+  return ring;
+}
+
+inline void trace_record(const trace_event_t& event){
+  trace_ring_t* ring = trace_thread_ring();
+  if (ring == NULL){
+    return;
+  }
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) == TRACE_RING_EVENTS){
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  ring->events[head & (TRACE_RING_EVENTS - 1)] = event;
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+inline void trace_instant(const char* name, const char* key0 = NULL, int64_t arg0 = 0, const char* key1 = NULL, int64_t arg1 = 0){
+  if (trace_sampled()){
+    trace_record(trace_event_t{name, 'i', trace_clock(), 0, {key0, key1}, {arg0, arg1}});
+  }
+}
+
+// A stage of a sampled action, recorded as one complete event when it ends.
+class trace_span_t
+{
+public:
+    trace_span_t(const char* name) : name(name), start(trace_sampled() ? trace_clock() : 0) {}
+
+    ~trace_span_t(){
+      if (start != 0){
+        trace_record(trace_event_t{name, 'X', start, trace_clock() - start, {NULL, NULL}, {0, 0}});
+      }
+    }
+private:
+    const char* name;
+    uint64_t start;
+};
+
+// One action: decides whether it is sampled and records its whole span,
+// tagged with its sequence number.
+class trace_action_t
+{
+public:
+    trace_action_t(uint64_t sequence) : sequence(sequence), start(0) {
+      trace_session_t& session = trace_session();
+      if (session.on.load(std::memory_order_relaxed)
+          && session.actions.fetch_add(1, std::memory_order_relaxed) % session.sample_every == 0){
+        start = trace_clock();
+        trace_sampled() = true;
+        trace_record(trace_event_t{"receive", 'i', start, 0, {"seq", NULL}, {(int64_t)sequence, 0}});
+      }
+    }
+
+    ~trace_action_t(){
+      if (start != 0){
+        trace_sampled() = false;
+        trace_record(trace_event_t{"action", 'X', start, trace_clock() - start, {"seq", NULL}, {(int64_t)sequence, 0}});
+      }
+    }
+private:
+    uint64_t sequence;
+    uint64_t start;
+};
+
+// Appends every ring's pending events to the file (flusher thread only).
+inline void trace_drain(trace_session_t& session){
+  int threads = std::min(session.threads.load(), TRACE_MAX_THREADS);
+  for (int t = 0; t < threads; t++){
+    trace_ring_t* ring = session.rings[t].load(std::memory_order_acquire);
+    if (ring == NULL){
+      continue;
+    }
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    for (; tail != head; tail++){
+      const trace_event_t& event = ring->events[tail & (TRACE_RING_EVENTS - 1)];
+      fprintf(session.file, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,", session.first ? "" : ",",
+              event.name, event.phase, event.ts / 1000.0);
+      if (event.phase == 'X'){
+        fprintf(session.file, "\"dur\":%.3f,", event.dur / 1000.0);
+      } else {
+        fprintf(session.file, "\"s\":\"t\",");
+      }
+      fprintf(session.file, "\"pid\":1,\"tid\":%d", ring->tid);
+      if (event.keys[0] != NULL){
+        fprintf(session.file, ",\"args\":{\"%s\":%lld", event.keys[0], (long long)event.args[0]);
+        if (event.keys[1] != NULL){
+          fprintf(session.file, ",\"%s\":%lld", event.keys[1], (long long)event.args[1]);
+        }
+        fprintf(session.file, "}");
+      }
+      fprintf(session.file, "}");
+      session.first = false;
+      session.written++;
+    }
+    ring->tail.store(tail, std::memory_order_release);
+  }
+  fflush(session.file);
+}
+
+// Starts tracing every `sample_every`th action into a new JSON file at path.
+inline bool trace_start(const std::string& path, uint64_t sample_every, std::string& error){
+  trace_session_t& session = trace_session();
+  session.file = fopen(path.c_str(), "w");
+  if (session.file == NULL){
+    error = "Cannot create trace " + path + ": " + strerror(errno);
+    return false;
+  }
+  fprintf(session.file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  session.sample_every = sample_every ? sample_every : 1;
+  session.flusher = std::thread([&session]() {
+    std::unique_lock<std::mutex> guard(session.lock);
+    while (!session.stopping){
+      session.wake.wait_for(guard, std::chrono::milliseconds(10));
+      trace_drain(session);
+    }
+  });
+  session.on.store(true);
+  return true;
+}
+
+// Stops sampling, writes out the remaining events and closes the file.
+// Returns a one-line summary: events written and dropped.
+inline std::string trace_stop(){
+  trace_session_t& session = trace_session();
+  if (session.file == NULL){
+    return "";
+  }
+  session.on.store(false);
+  {
+    std::lock_guard<std::mutex> guard(session.lock);
+    session.stopping = true;
+  }
+  session.wake.notify_one();
+  session.flusher.join();
+  trace_drain(session);
+  uint64_t dropped = 0;
+  for (int t = 0; t < std::min(session.threads.load(), TRACE_MAX_THREADS); t++){
+    trace_ring_t* ring = session.rings[t].load();
+    dropped += ring == NULL ? 0 : ring->dropped.load();
+  }
+  fprintf(session.file, "\n]}\n");
+  fclose(session.file);
+  session.file = NULL;
+  char text[128];
+  snprintf(text, sizeof(text), "trace: %llu events written, %llu dropped\n",
+           (unsigned long long)session.written, (unsigned long long)dropped);
+  return text;
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#ifdef SIMPLE_CROSS_TRACE
+#define TRACE_ACTION(sequence) trace_action_t TRACE_CONCAT(trace_action_, __LINE__)(sequence)
+#define TRACE_SPAN(name) trace_span_t TRACE_CONCAT(trace_span_, __LINE__)(name)
+#define TRACE_INSTANT(...) trace_instant(__VA_ARGS__)
+#else
+#define TRACE_ACTION(sequence)
+#define TRACE_SPAN(name)
+#define TRACE_INSTANT(...)
+#endif
+
+#endif
@@ -0,0 +1,594 @@
+/*
+io_uring backend for the order entry server.
+
+Same protocol and routing as the epoll server (see order_server.h), but all
+socket I/O goes through a single io_uring instance driven with raw syscalls
+(no liburing):
+    * one multishot accept on the listening socket
+    * one multishot recv per connection, drawing from a registered provided
+      buffer ring, so a connection costs no syscall per message received
+    * output is copied into slots of a registered (fixed) buffer arena and
+      written with IORING_OP_WRITE_FIXED; all writes produced while handling a
+      batch of completions are submitted together with the next wait, so many
+      sessions share one kernel transition
+    * with a market data publisher, one multishot poll on its snapshot socket
+
+start() reports URING_UNSUPPORTED when the kernel cannot provide any of the
+above (io_uring disabled or missing, no provided buffer rings, no multishot
+recv before Linux 6.0); the caller then falls back to the epoll server.
+*/
+#ifndef URING_SERVER_H
+#define URING_SERVER_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "order_server.h"
+
+enum uring_status_t {
+  URING_OK = 0,
+  URING_UNSUPPORTED,
+  URING_FAILED
+};
+
+// Minimal io_uring submission/completion ring over the raw syscalls.
+class io_ring_t
+{
+public:
+    io_ring_t() : ring_fd(-1), sq_ptr(NULL), cq_ptr(NULL), sqes(NULL), sq_size(0), cq_size(0), sqe_size(0), sqe_tail(0), submitted(0) {}
+
+    ~io_ring_t(){
+      if (sqes != NULL) munmap(sqes, sqe_size);
+      if (cq_ptr != NULL && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+      if (sq_ptr != NULL) munmap(sq_ptr, sq_size);
+      if (ring_fd >= 0) close(ring_fd);
+    }
+
+    // Returns 0 or a negative errno.
+    int setup(unsigned entries){
+      struct io_uring_params params;
+      memset(&params, 0, sizeof(params));
+      ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+      if (ring_fd < 0){
+        return -errno;
+      }
+      sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+      bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+      if (single_mmap){
+        sq_size = cq_size = std::max(sq_size, cq_size);
+      }
+      sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+      cq_ptr = single_mmap ? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+      sqe_size = params.sq_entries * sizeof(struct io_uring_sqe);
+      sqes = static_cast<struct io_uring_sqe*>(map(sqe_size, IORING_OFF_SQES));
+      if (sq_ptr == NULL || cq_ptr == NULL || sqes == NULL){
+        return -ENOMEM;
+      }
+      char* sq = static_cast<char*>(sq_ptr);
+      char* cq = static_cast<char*>(cq_ptr);
+      sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+      sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+      sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+      sq_entries = params.sq_entries;
+      sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+      cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+      cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+      cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+      cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+      sqe_tail = submitted = *sq_tail;
+      return 0;
+    }
+
+    int register_resource(unsigned opcode, void* arg, unsigned count){
+      int rc = syscall(__NR_io_uring_register, ring_fd, opcode, arg, count);
+      return rc < 0 ? -errno : rc;
+    }
+
+    // True if every opcode in the list is supported by this kernel.
+    bool supports(const std::vector<int>& opcodes){
+      size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+      std::vector<char> buffer(size, 0);
+      struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(buffer.data());
+      if (register_resource(IORING_REGISTER_PROBE, probe, 256) < 0){
+        return false;
+      }
+      for (int opcode : opcodes){
+        if (opcode > probe->last_op || !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)){
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Returns a zeroed SQE, submitting queued entries first if the ring is full.
+    struct io_uring_sqe* get_sqe(){
+      if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries){
+        submit(0);
+      }
+      unsigned index = sqe_tail & sq_mask;
+      struct io_uring_sqe* sqe = &sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sq_array[index] = index;
+      sqe_tail++;
+      return sqe;
+    }
+
+    // Publishes all queued SQEs and waits for at least wait_for completions,
+    // in a single io_uring_enter. Returns the kernel's result or -errno.
+    int submit(unsigned wait_for){
+      __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+      unsigned to_submit = sqe_tail - submitted;
+      unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+      int rc = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_for, flags, NULL, 0);
+      if (rc < 0){
+        return -errno;
+      }
+      submitted += rc;
+      return rc;
+    }
+
+    // Calls handle(cqe) for every available completion and retires them.
+    template <typename Handle>
+    unsigned drain(Handle handle){
+      unsigned head = *cq_head;
+      unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+      unsigned count = 0;
+      while (head != tail){
+        handle(cqes[head & cq_mask]);
+        head++;
+        count++;
+      }
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+      return count;
+    }
+private:
+    void* map(size_t size, off_t offset){
+      void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+      return ptr == MAP_FAILED ? NULL : ptr;
+    }
+
+    int ring_fd;
+    void* sq_ptr;
+    void* cq_ptr;
+    struct io_uring_sqe* sqes;
+    size_t sq_size, cq_size, sqe_size;
+    unsigned *sq_head, *sq_tail, *sq_array, *cq_head, *cq_tail;
+    unsigned sq_mask, sq_entries, cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned sqe_tail;
+    unsigned submitted;
+};
+
+// Multishot recv needs Linux 6.0; there is no feature bit for it.
+inline bool kernel_at_least(int major, int minor){
+  struct utsname name;
+  int kernel_major = 0, kernel_minor = 0;
+  if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &kernel_major, &kernel_minor) != 2){
+    return false;
+  }
+  return kernel_major > major || (kernel_major == major && kernel_minor >= minor);
+}
+
+class uring_server_t
+{
+public:
+    uring_server_t(SimpleCross& engine) : router(engine), listen_fd(-1), next_session(1),
+                                          recv_arena(NULL), recv_ring(NULL), write_arena(NULL), publisher(NULL) {}
+
+    ~uring_server_t(){
+      for (std::unordered_map<uint64_t, connection_t>::iterator it = connections.begin(); it != connections.end(); ++it){
+        close(it->second.fd);
+      }
+      if (listen_fd >= 0) close(listen_fd);
+      if (recv_ring != NULL) munmap(recv_ring, RECV_RING_BYTES);
+      if (recv_arena != NULL) munmap(recv_arena, RECV_BUFFERS * RECV_BUFFER_SIZE);
+      if (write_arena != NULL) munmap(write_arena, WRITE_SLOTS * WRITE_SLOT_SIZE);
+    }
+
+    // Holds results until durable when the journal runs in sync mode.
+    void set_journal(journal_t* journal){
+      router.set_journal(journal);
+    }
+
+    // Answers the publisher's snapshot requests from the ring, so they do not
+    // wait for the next action. Call before start().
+    void set_publisher(md_publisher_t* md_publisher){
+      publisher = md_publisher;
+    }
+
+    uring_status_t start(const std::string& endpoint, std::string& error){
+      if (!kernel_at_least(6, 0)){
+        error = "multishot recv needs Linux 6.0 or later";
+        return URING_UNSUPPORTED;
+      }
+      int rc = ring.setup(RING_ENTRIES);
+      if (rc < 0){
+        error = std::string("io_uring_setup failed: ") + strerror(-rc);
+        return URING_UNSUPPORTED;
+      }
+      if (!ring.supports({IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_WRITE_FIXED, IORING_OP_POLL_ADD})){
+        error = "kernel lacks io_uring accept/recv/write_fixed/poll_add";
+        return URING_UNSUPPORTED;
+      }
+      if (!setup_buffers(error)){
+        return URING_UNSUPPORTED;
+      }
+      tcp = endpoint.compare(0, 4, "tcp:") == 0;
+      listen_fd = open_listener(endpoint, error);
+      if (listen_fd < 0){
+        return URING_FAILED;
+      }
+      arm_accept();
+      if (publisher != NULL){
+        arm_snapshot_poll();
+      }
+      return URING_OK;
+    }
+
+    // Runs until SIGINT/SIGTERM.
+    void run(){
+      while (!server_stop_requested){
+        int rc = ring.submit(1);
+        if (rc < 0 && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY){
+          std::cerr << "io_uring_enter failed: " << strerror(-rc) << std::endl;
+          break;
+        }
+        ring.drain([this](const struct io_uring_cqe& cqe){
+          this->complete(cqe);
+        });
+        publish_recv_buffers();
+        close_stalled();
+        queue_writes();
+      }
+    }
+private:
+    static constexpr unsigned RING_ENTRIES = 1024;
+    static constexpr unsigned RECV_BUFFERS = 256;
+    static constexpr size_t RECV_BUFFER_SIZE = 4096;
+    static constexpr size_t RECV_RING_BYTES = RECV_BUFFERS * sizeof(struct io_uring_buf);
+    static constexpr unsigned RECV_GROUP = 0;
+    static constexpr unsigned WRITE_SLOTS = 128;
+    static constexpr size_t WRITE_SLOT_SIZE = 16 * 1024;
+
+    enum operation_t {
+      OP_ACCEPT = 1,
+      OP_RECV = 2,
+      OP_WRITE = 3,
+      OP_POLL = 4
+    };
+
+    struct connection_t {
+      int fd;
+      std::string input;
+      std::string output;
+      int write_slot;         // -1 when no write is in flight
+      size_t write_offset;
+      size_t write_length;
+      bool receiving;
+      bool closing;
+      bool queued;
+      bool stalled;           // over MAX_PENDING_OUTPUT, being closed
+    };
+
+    static uint64_t user_data(uint64_t session, operation_t operation){
+      return (session << 4) | operation;
+    }
+
+    static void* map_anonymous(size_t size){
+      void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+      return ptr == MAP_FAILED ? NULL : ptr;
+    }
+
+    // Registers the provided buffer ring for receives and the fixed buffer
+    // arena for writes.
+    bool setup_buffers(std::string& error){
+      recv_arena = static_cast<char*>(map_anonymous(RECV_BUFFERS * RECV_BUFFER_SIZE));
+      recv_ring = static_cast<struct io_uring_buf_ring*>(map_anonymous(RECV_RING_BYTES));
+      write_arena = static_cast<char*>(map_anonymous(WRITE_SLOTS * WRITE_SLOT_SIZE));
+      if (recv_arena == NULL || recv_ring == NULL || write_arena == NULL){
+        error = "cannot allocate io_uring buffers";
+        return false;
+      }
+      struct io_uring_buf_reg registration;
+      memset(&registration, 0, sizeof(registration));
+      registration.ring_addr = reinterpret_cast<uint64_t>(recv_ring);
+      registration.ring_entries = RECV_BUFFERS;
+      registration.bgid = RECV_GROUP;
+      int rc = ring.register_resource(IORING_REGISTER_PBUF_RING, &registration, 1);
+      if (rc < 0){
+        error = std::string("cannot register provided buffer ring: ") + strerror(-rc);
+        return false;
+      }
+      recv_tail = 0;
+      for (unsigned bid = 0; bid < RECV_BUFFERS; bid++){
+        return_recv_buffer(bid);
+      }
+      publish_recv_buffers();
+      struct iovec arena;
+      arena.iov_base = write_arena;
+      arena.iov_len = WRITE_SLOTS * WRITE_SLOT_SIZE;
+      rc = ring.register_resource(IORING_REGISTER_BUFFERS, &arena, 1);
+      if (rc < 0){
+        error = std::string("cannot register write buffers: ") + strerror(-rc);
+        return false;
+      }
+      for (unsigned slot = 0; slot < WRITE_SLOTS; slot++){
+        free_slots.push_back(WRITE_SLOTS - 1 - slot);
+      }
+      return true;
+    }
+
+    void return_recv_buffer(unsigned bid){
+      // Index the entries through a plain io_uring_buf pointer: in C++ the
+      // kernel header's flexible array member lands 8 bytes into the ring.
+      struct io_uring_buf* buffer = reinterpret_cast<struct io_uring_buf*>(recv_ring) + (recv_tail & (RECV_BUFFERS - 1));
+      buffer->addr = reinterpret_cast<uint64_t>(recv_arena + bid * RECV_BUFFER_SIZE);
+      buffer->len = RECV_BUFFER_SIZE;
+      buffer->bid = bid;
+      recv_tail++;
+    }
+
+    void publish_recv_buffers(){
+      __atomic_store_n(&recv_ring->tail, recv_tail, __ATOMIC_RELEASE);
+    }
+
+    void arm_accept(){
+      struct io_uring_sqe* sqe = ring.get_sqe();
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = listen_fd;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->user_data = user_data(0, OP_ACCEPT);
+    }
+
+    void arm_recv(uint64_t session, connection_t& connection){
+      struct io_uring_sqe* sqe = ring.get_sqe();
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = connection.fd;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = RECV_GROUP;
+      sqe->user_data = user_data(session, OP_RECV);
+      connection.receiving = true;
+    }
+
+    void arm_snapshot_poll(){
+      struct io_uring_sqe* sqe = ring.get_sqe();
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = publisher->snapshot_socket();
+      sqe->poll32_events = POLLIN;
+      sqe->len = IORING_POLL_ADD_MULTI;
+      sqe->user_data = user_data(0, OP_POLL);
+    }
+
+    void complete(const struct io_uring_cqe& cqe){
+      uint64_t session = cqe.user_data >> 4;
+      switch (cqe.user_data & 0xf){
+        case OP_ACCEPT:
+          accepted(cqe);
+          break;
+        case OP_RECV:
+          received(session, cqe);
+          break;
+        case OP_WRITE:
+          written(session, cqe);
+          break;
+        case OP_POLL:
+          if (cqe.res > 0){
+            publisher->serve_snapshots();
+          }
+          if (cqe.res >= 0 && !(cqe.flags & IORING_CQE_F_MORE)){
+            arm_snapshot_poll();
+          }
+          break;
+      }
+    }
+
+    void accepted(const struct io_uring_cqe& cqe){
+      if (cqe.res >= 0){
+        if (tcp){
+          int one = 1;
+          setsockopt(cqe.res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        uint64_t session = next_session++;
+        connection_t& connection = connections[session];
+        connection.fd = cqe.res;
+        connection.write_slot = -1;
+        connection.write_offset = connection.write_length = 0;
+        connection.closing = false;
+        connection.queued = false;
+        connection.stalled = false;
+        arm_recv(session, connection);
+      } else if (cqe.res != -EINTR && cqe.res != -EAGAIN){
+        std::cerr << "accept failed: " << strerror(-cqe.res) << std::endl;
+      }
+      if (!(cqe.flags & IORING_CQE_F_MORE)){
+        arm_accept();
+      }
+    }
+
+    void received(uint64_t session, const struct io_uring_cqe& cqe){
+      std::unordered_map<uint64_t, connection_t>::iterator it = connections.find(session);
+      if (cqe.flags & IORING_CQE_F_BUFFER){
+        unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (it != connections.end() && cqe.res > 0){
+          it->second.input.append(recv_arena + bid * RECV_BUFFER_SIZE, cqe.res);
+        }
+        return_recv_buffer(bid);
+      }
+      if (it == connections.end()){
+        return;
+      }
+      connection_t& connection = it->second;
+      if (cqe.res > 0){
+        router.dispatch_input(session, connection.input, [this, session](uint64_t destination, const std::string& result){
+          this->send(destination, result, session);
+        });
+      } else if (cqe.res != -ENOBUFS){
+        connection.closing = true;
+      }
+      if (!(cqe.flags & IORING_CQE_F_MORE)){
+        connection.receiving = false;
+        if (connection.closing){
+          maybe_close(session);
+        } else {
+          arm_recv(session, connection);
+        }
+      }
+    }
+
+    // Same contract as epoll_server_t::send(): a session that stopped reading
+    // is marked stalled rather than allowed to hold broadcast output.
+    void send(uint64_t session, const std::string& result, uint64_t requester){
+      if (session == EVERY_SESSION){
+        for (std::unordered_map<uint64_t, connection_t>::const_iterator it = connections.begin(); it != connections.end(); ++it){
+          send(it->first, result, requester);
+        }
+        return;
+      }
+      std::unordered_map<uint64_t, connection_t>::iterator it = connections.find(session);
+      if (it == connections.end() || it->second.stalled){
+        return;
+      }
+      connection_t& connection = it->second;
+      if (session != requester && connection.output.size() >= MAX_PENDING_OUTPUT){
+        connection.stalled = true;
+        connection.closing = true;
+        connection.output.clear();
+        stalled.push_back(session);
+        return;
+      }
+      connection.output += result;
+      connection.output += '\n';
+      if (!connection.queued && connection.write_slot < 0){
+        connection.queued = true;
+        pending.push_back(session);
+      }
+    }
+
+    // Moves queued output of every pending session into a fixed buffer slot
+    // and prepares its write; the SQEs go out with the next submit.
+    void queue_writes(){
+      size_t kept = 0;
+      for (size_t i = 0; i < pending.size(); i++){
+        uint64_t session = pending[i];
+        std::unordered_map<uint64_t, connection_t>::iterator it = connections.find(session);
+        if (it == connections.end()){
+          continue;
+        }
+        connection_t& connection = it->second;
+        if (free_slots.empty()){
+          pending[kept++] = session;
+          continue;
+        }
+        connection.queued = false;
+        connection.write_slot = free_slots.back();
+        free_slots.pop_back();
+        connection.write_length = std::min(connection.output.size(), WRITE_SLOT_SIZE);
+        connection.write_offset = 0;
+        memcpy(write_arena + connection.write_slot * WRITE_SLOT_SIZE, connection.output.data(), connection.write_length);
+        connection.output.erase(0, connection.write_length);
+        submit_write(session, connection);
+      }
+      pending.resize(kept);
+    }
+
+    void submit_write(uint64_t session, const connection_t& connection){
+      struct io_uring_sqe* sqe = ring.get_sqe();
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->fd = connection.fd;
+      sqe->addr = reinterpret_cast<uint64_t>(write_arena + connection.write_slot * WRITE_SLOT_SIZE + connection.write_offset);
+      sqe->len = connection.write_length - connection.write_offset;
+      sqe->buf_index = 0;
+      sqe->user_data = user_data(session, OP_WRITE);
+    }
+
+    void written(uint64_t session, const struct io_uring_cqe& cqe){
+      std::unordered_map<uint64_t, connection_t>::iterator it = connections.find(session);
+      if (it == connections.end()){
+        return;
+      }
+      connection_t& connection = it->second;
+      if (cqe.res > 0){
+        connection.write_offset += cqe.res;
+        if (connection.write_offset < connection.write_length){
+          submit_write(session, connection);
+          return;
+        }
+      }
+      free_slots.push_back(connection.write_slot);
+      connection.write_slot = -1;
+      if (cqe.res <= 0){
+        connection.output.clear();
+        connection.closing = true;
+      }
+      if (!connection.output.empty()){
+        connection.queued = true;
+        pending.push_back(session);
+      } else if (connection.closing){
+        maybe_close(session);
+      }
+    }
+
+    // Closes the sessions send() found stalled. Shutting down both directions
+    // ends their recv and fails a write stuck on a full socket, so
+    // maybe_close() finishes the job when those complete.
+    void close_stalled(){
+      for (uint64_t session : stalled){
+        std::unordered_map<uint64_t, connection_t>::iterator it = connections.find(session);
+        if (it != connections.end()){
+          std::cerr << "session " << session << " stopped reading, disconnected" << std::endl;
+          shutdown(it->second.fd, SHUT_RDWR);
+          maybe_close(session);
+        }
+      }
+      stalled.clear();
+    }
+
+    // Closes a connection once neither a recv nor a write is outstanding.
+    void maybe_close(uint64_t session){
+      std::unordered_map<uint64_t, connection_t>::iterator it = connections.find(session);
+      if (it == connections.end()){
+        return;
+      }
+      connection_t& connection = it->second;
+      if (connection.receiving || connection.write_slot >= 0 || !connection.output.empty()){
+        if (connection.receiving){
+          shutdown(connection.fd, SHUT_RD);
+        }
+        return;
+      }
+      close(connection.fd);
+      connections.erase(it);
+    }
+
+    io_ring_t ring;
+    session_router_t router;
+    int listen_fd;
+    bool tcp;
+    uint64_t next_session;
+    char* recv_arena;
+    struct io_uring_buf_ring* recv_ring;
+    unsigned short recv_tail;
+    char* write_arena;
+    std::vector<int> free_slots;
+    std::unordered_map<uint64_t, connection_t> connections;
+    std::vector<uint64_t> pending;
+    std::vector<uint64_t> stalled;
+    md_publisher_t* publisher;
+};
+
+#endif
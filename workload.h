@@ -0,0 +1,111 @@
+/*
+Synthetic order flow for benchmarks.
+
+Symbols are picked with a Zipf distribution (rank k has weight 1/k^s), so a
+few symbols carry most of the flow. Each symbol has a mid price that takes a
+random walk of one tick at a time. An action is a cancel (of a random order
+this generator entered earlier, which may since have been filled) or a new
+order; a new order is either passive, resting 1..depth ticks behind the mid
+on its side, or aggressive, priced 0..depth-1 ticks through the mid so that
+it crosses whatever rests there.
+
+The generator is open loop: it does not see the engine's results, so the
+same parameters and seed always give the same actions.
+*/
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+
+struct workload_options_t {
+  size_t symbols = 100;
+  double zipf = 1.0;              // Zipf exponent of symbol popularity (0: uniform)
+  double cancel_ratio = 0.3;      // share of actions that are cancels
+  double aggressive_ratio = 0.1;  // share of new orders priced through the mid
+  int depth = 10;                 // ticks over which prices spread from the mid
+  double volatility = 0.1;        // chance the mid moves one tick per order
+  int max_qty = 100;
+  int64_t start_px = 10000;       // initial mid, in ticks
+  int tick_decimals = 2;          // a tick is 10^-tick_decimals
+  uint64_t seed = 1;
+};
+
+class workload_t
+{
+public:
+    workload_t(const workload_options_t& options) : options(options), random(options.seed), next_oid(1) {
+      double total = 0;
+      for (size_t rank = 1; rank <= options.symbols; rank++){
+        total += 1.0 / std::pow((double)rank, options.zipf);
+        popularity.push_back(total);
+      }
+      for (size_t i = 0; i < options.symbols; i++){
+        popularity[i] /= total;
+        symbols.push_back("S" + std::to_string(i));
+        mids.push_back(options.start_px);
+      }
+    }
+
+    // Writes the next action into line.
+    void next(std::string& line){
+      char text[96];
+      int length;
+      if (!open.empty() && uniform(random) < options.cancel_ratio){
+        size_t pick = random() % open.size();
+        length = snprintf(text, sizeof(text), "X %d", open[pick]);
+        open[pick] = open.back();
+        open.pop_back();
+      } else {
+        size_t symbol = std::lower_bound(popularity.begin(), popularity.end(), uniform(random)) - popularity.begin();
+        symbol = std::min(symbol, symbols.size() - 1);
+        int64_t& mid = mids[symbol];
+        if (uniform(random) < options.volatility){
+          mid += (random() & 1) ? 1 : -1;
+          mid = std::max(mid, (int64_t)options.depth + 1);
+        }
+        bool buy = random() & 1;
+        int64_t offset = uniform(random) < options.aggressive_ratio
+          ? -(int64_t)(random() % options.depth)
+          : 1 + (int64_t)(random() % options.depth);
+        int64_t px = buy ? mid - offset : mid + offset;
+        int qty = 1 + (int)(random() % options.max_qty);
+        int oid = next_oid++;
+        length = snprintf(text, sizeof(text), "O %d %s %c %d ", oid, symbols[symbol].c_str(), buy ? 'B' : 'S', qty);
+        length += format_px(text + length, px);
+        open.push_back(oid);
+      }
+      line.assign(text, length);
+    }
+    // Every symbol the flow can name, by rank.
+    const std::vector<std::string>& symbol_names() const {
+      return symbols;
+    }
+private:
+    int format_px(char* text, int64_t px){
+      int64_t scale = 1;
+      for (int i = 0; i < options.tick_decimals; i++){
+        scale *= 10;
+      }
+      if (options.tick_decimals == 0){
+        return sprintf(text, "%lld", (long long)px);
+      }
+      return sprintf(text, "%lld.%0*lld", (long long)(px / scale), options.tick_decimals, (long long)(px % scale));
+    }
+
+    workload_options_t options;
+    std::mt19937_64 random;
+    std::uniform_real_distribution<double> uniform;
+    std::vector<double> popularity;       // cumulative, by rank
+    std::vector<std::string> symbols;
+    std::vector<int64_t> mids;
+    std::vector<int> open;                // orders that may still rest
+    int next_oid;
+};
+
+#endif